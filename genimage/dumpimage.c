@@ -11,14 +11,88 @@
 #include <malloc.h>
 #include <libgen.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "fmh.h"
 
-static unsigned char FirmwareInfo[64*1024];
+static unsigned char FirmwareInfo[64*1024];	/* Copy for dump_fwinfo to tokenize */
 static UINT32 Location;	/* Flash Location Value */
 static INT32 BlockSize;	/* Size of each Flash Block */
 
 static int summary = 0;
+static int verify = 0;
+static int noindex = 0;
+
+/* A module found in the FMH chain, to be extracted */
+struct dump_job {
+	MODULE_INFO *mod;
+	char name[9];
+	unsigned char *sec;	/* Start of its section in the image mapping */
+	size_t avail;		/* What the image has from there */
+	UINT32 crc;		/* crc32 of what was written */
+	int status;		/* 0 once written */
+	int entry;		/* Its FMH in the table, when streamed */
+	long spool_pos;		/* Where it is in module_out, when spooled */
+	size_t spool_len;
+};
+
+/* A range of the image whose crc32 is part of the image checksum */
+struct crc_piece {
+	unsigned char *data;
+	size_t len;
+	UINT32 crc;
+};
+
+/* An FMH found in the image, and the block that holds it */
+struct fmh_entry {
+	UINT32 pos;
+	FMH fmh;
+};
+
+/* Sidecar index of an image, kept next to it: the FMH table and the
+ * firmware information, for -s and -m while the image is unchanged */
+#define INDEX_SUFFIX	".fmhidx"
+#define INDEX_MAGIC	"DUMPIMAGE-IDX 1"
+
+struct index_header {
+	char magic[16];
+	long long size;		/* Identity of the image */
+	long long mtime;	/* In nano seconds */
+	long long ino;
+	long long fmh_offset;	/* -f it was built with */
+	UINT32 block_size;
+	UINT32 nfmh;
+	UINT32 fwinfo_size;
+};
+
+/* What one pass over a stream (-i -, pipes) leaves: the FMH table as
+ * from walk_image, the modules written on the way and the image size */
+struct stream_result {
+	struct fmh_entry *table;
+	int nfmh;
+	struct dump_job *jobs;
+	int njobs;
+	size_t size;
+	UINT32 image_crc;	/* Image checksum, for -V */
+};
+
+#define DUMP_CHUNK_SIZE	(1024*1024)
+#define CRC_PIECE_SIZE	(4*1024*1024)
+
+/* Worker pool state for run_dump_jobs */
+static struct dump_job *dump_jobs;
+static int dump_njobs;
+static struct crc_piece *crc_pieces;
+static int crc_npieces;
+static int dump_next;
+static const char *dump_dir;
+
+/* Where -m writes the modules when there is no output path. A stream
+ * writes them to a spool file in image order, and they are copied to
+ * module_dest in the order they were named (see copy_spooled) */
+static FILE *module_out = NULL;
+static FILE *module_dest = NULL;
 
 static void update_name(MODULE_INFO *mod, char *name)
 {
@@ -126,46 +200,711 @@ static void dump_fmh(FMH *fmh, MODULE_INFO *mod, char *name, FILE *out)
 	fputs("\n", out);
 }
 
-static void dump_module(FMH *fmh, MODULE_INFO *mod, char *name, FILE *fd, const char *dir)
+/* Where a module goes: module_out (-m), <dir>/<NAME>.bin, or nowhere
+ * without a dir (-V) */
+static int open_module(const char *name, const char *dir, FILE **out, char *outfile)
 {
+	*out = NULL;
+	if (module_out != NULL)
+	{
+		*out = module_out;
+		strcpy(outfile, "standard output");
+	}
+	else if (dir != NULL)
+	{
+		snprintf(outfile, 256, "%s/%s.bin", dir, name);
+		*out = fopen(outfile, "w+");
+		if (*out == NULL)
+		{
+			printf("Error: Unable to create file %s\n", outfile);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* The module is written straight from the image mapping, and its crc32
+ * is calculated on the same bytes as they are written. Without a dir
+ * (-V) only the crc32 is calculated */
+static int dump_module(struct dump_job *job, const char *dir)
+{
+	MODULE_INFO *mod = job->mod;
 	FILE *out;
 	char outfile[256];
-	char *in_p;
+	UINT32 done, len;
 
-	if (mod->Module_Type == MODULE_FMH_FIRMWARE
-	    || mod->Module_Type == MODULE_FIRMWARE_1_4)
+	if (mod->Module_Location > job->avail
+	    || mod->Module_Size > job->avail - mod->Module_Location)
 	{
-		return;
+		printf("Error: Module %s is beyond the end of the image\n", job->name);
+		return 1;
 	}
 
-#if 0
-	printf("\nFMH Size %08x Location %08x Alloc %08x\n", fmh->FMH_Size, fmh->FMH_Location, fmh->FMH_AllocatedSize);
-	printf("MOD Size %08x Location %08x\n", mod->Module_Size, mod->Module_Location);
-	printf("mmap %08x @ %08x\n", fmh->FMH_AllocatedSize, fmh->FMH_Location + mod->Module_Location);
-#endif
+	if (open_module(job->name, dir, &out, outfile) != 0)
+		return 1;
+
+	BeginCRC32(&job->crc);
+	for (done = 0; done < mod->Module_Size; done += len)
+	{
+		len = mod->Module_Size - done;
+		if (len > DUMP_CHUNK_SIZE)
+			len = DUMP_CHUNK_SIZE;
+		UpdateCRC32(&job->crc, job->sec + mod->Module_Location + done, len);
+		if (out != NULL
+		    && fwrite(job->sec + mod->Module_Location + done, len, 1, out) != 1)
+		{
+			printf("Error: Unable to write to file %s\n", outfile);
+			if (out != module_out)
+				fclose(out);
+			return 1;
+		}
+	}
+	EndCRC32(&job->crc);
 
-	printf(" -- processing %s...\n", name);
+	if (out == module_out)
+		out = NULL;
+	if (out != NULL && fclose(out) != 0)
+	{
+		printf("Error: Unable to write to file %s\n", outfile);
+		return 1;
+	}
+	return 0;
+}
 
-	in_p = mmap(NULL, fmh->FMH_AllocatedSize, PROT_READ,
-		    MAP_SHARED, fileno(fd), fmh->FMH_Location & (~0xffff));
+static void *dump_worker(void *arg)
+{
+	struct crc_piece *piece;
+	int j;
 
-	snprintf(outfile, 256, "%s/%s.bin", dir, name);
-	out = fopen(outfile, "w+");
-	if (out == NULL)
+	while ((j = __sync_fetch_and_add(&dump_next, 1)) < dump_njobs + crc_npieces)
 	{
-		printf("Error: Unable to create file %s\n", outfile);
-		return;
+		if (j < dump_njobs)
+		{
+			dump_jobs[j].status = dump_module(&dump_jobs[j], dump_dir);
+			continue;
+		}
+		piece = &crc_pieces[j - dump_njobs];
+		piece->crc = CalculateCRC32(piece->data, piece->len);
 	}
+	return NULL;
+}
 
-	if (fwrite(in_p + mod->Module_Location, mod->Module_Size, 1, out) != 1)
+/* Extract the modules and calculate the crc32 of the image pieces with
+ * up to nthreads workers. Each module goes to its own file, so they only
+ * share the read only image mapping */
+static void run_dump_jobs(struct dump_job *jobs, int njobs, struct crc_piece *pieces,
+			  int npieces, int nthreads, const char *dir)
+{
+	pthread_t *threads;
+	int t, started = 0;
+
+	dump_jobs = jobs;
+	dump_njobs = njobs;
+	crc_pieces = pieces;
+	crc_npieces = npieces;
+	dump_next = 0;
+	dump_dir = dir;
+
+	if (nthreads > njobs + npieces)
+		nthreads = njobs + npieces;
+	threads = malloc(nthreads * sizeof(pthread_t));
+	if (threads != NULL)
 	{
-		printf("Error: Unable to write to file %s\n", outfile);
+		for (t = 0; t < nthreads; t++)
+		{
+			if (pthread_create(&threads[started], NULL, dump_worker, NULL) != 0)
+				break;
+			started++;
+		}
+	}
+
+	/* Whatever no worker could be started for is extracted here */
+	dump_worker(NULL);
+
+	for (t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+}
+
+/* Check each extracted module against the checksum in its FMH. Returns
+ * the number of modules that failed */
+static int report_modules(struct dump_job *jobs, int njobs)
+{
+	MODULE_INFO *mod;
+	int j, bad = 0;
+
+	printf("Module checksums :\n");
+	for (j = 0; j < njobs; j++)
+	{
+		mod = jobs[j].mod;
+		if (jobs[j].status != 0)
+		{
+			printf("\t%-8s  %s\n", jobs[j].name, verify ? "UNREADABLE" : "NOT EXTRACTED");
+			bad++;
+		}
+		else if (!(mod->Module_Flags & MODULE_FLAG_VALID_CHECKSUM))
+			printf("\t%-8s  NO CHECKSUM\n", jobs[j].name);
+		else if (jobs[j].crc == le32_to_host(mod->Module_Checksum))
+			printf("\t%-8s  OK\n", jobs[j].name);
+		else
+		{
+			printf("\t%-8s  MISMATCH (FMH 0x%08x, data 0x%08x)\n", jobs[j].name,
+				le32_to_host(mod->Module_Checksum), jobs[j].crc);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/* Split what the image checksum covers into pieces of up to CRC_PIECE_SIZE.
+ * As in genimage (CalculateImageChecksum) it runs from the start of the
+ * image to the end of the FIRMWARE block at header, without the FMH header
+ * checksum and the module checksum fields of the FIRMWARE FMH */
+static struct crc_piece *image_crc_pieces(unsigned char *image, size_t header, int *npieces)
+{
+	size_t range[3][2] = {
+		{ 0, header + FMH_FMH_HEADER_CHECKSUM_OFFSET },
+		{ header + FMH_FMH_HEADER_CHECKSUM_OFFSET + 1, header + FMH_MODULE_CHECKSUM_START_OFFSET },
+		{ header + FMH_MODULE_CHCKSUM_END_OFFSET + 1, header + BlockSize },
+	};
+	struct crc_piece *pieces;
+	size_t pos, len;
+	int r, n = 0;
+
+	pieces = malloc((3 + (header + BlockSize) / CRC_PIECE_SIZE) * sizeof(struct crc_piece));
+	if (pieces == NULL)
+		return NULL;
+
+	for (r = 0; r < 3; r++)
+	{
+		for (pos = range[r][0]; pos < range[r][1]; pos += len)
+		{
+			len = range[r][1] - pos;
+			if (len > CRC_PIECE_SIZE)
+				len = CRC_PIECE_SIZE;
+			pieces[n].data = image + pos;
+			pieces[n].len = len;
+			n++;
+		}
+	}
+	*npieces = n;
+	return pieces;
+}
+
+/* A block that has an FMH signature but no valid FMH is a damaged header */
+static int bad_fmh(unsigned char *block)
+{
+	ALT_FMH *alt = (ALT_FMH *)(block + BlockSize - sizeof(ALT_FMH));
+
+	return !strncmp((char *)block, FMH_SIGNATURE, sizeof(FMH_SIGNATURE) - 1)
+	    || !strncmp((char *)alt->FMH_Signature, FMH_SIGNATURE, sizeof(FMH_SIGNATURE) - 1);
+}
+
+/* Walk the FMH chain of the image, hopping from one section FMH to the
+ * next by its allocated size. The table starts with the FIRMWARE FMH
+ * fw_fmh found at fw_pos. Damaged FMHs are reported and counted in *bad
+ * when verifying */
+static struct fmh_entry *walk_image(unsigned char *image, size_t image_size, FMH *fw_fmh,
+				    size_t fw_pos, int *nfmh, int *bad)
+{
+	struct fmh_entry *table, *more;
+	int n = 1, max = 16;
+	size_t pos, next;
+	FMH *fmh;
+
+	table = malloc(max * sizeof(struct fmh_entry));
+	if (table == NULL)
+		return NULL;
+	table[0].pos = fw_pos;
+	memcpy(&table[0].fmh, fw_fmh, sizeof(FMH));
+	Location = fw_fmh->FMH_Location;
+
+	for (pos = 0; pos + BlockSize <= image_size; pos = next)
+	{
+		next = pos + BlockSize;
+		fmh = ScanforFMH(image + pos, BlockSize);
+		if (fmh == NULL)
+		{
+			if (verify && bad_fmh(image + pos))
+			{
+				printf("Error: Damaged FMH in block at 0x%x\n", pos);
+				(*bad)++;
+			}
+			// Possible GAP, try next block
+			continue;
+		}
+
+		// Last block reached, stop
+		if (fmh->FMH_Location == Location)
+			break;
+
+		if (n == max)
+		{
+			max *= 2;
+			more = realloc(table, max * sizeof(struct fmh_entry));
+			if (more == NULL)
+			{
+				free(table);
+				return NULL;
+			}
+			table = more;
+		}
+		table[n].pos = pos;
+		memcpy(&table[n].fmh, fmh, sizeof(FMH));
+		n++;
+
+		// Skip the rest of the section
+		if (fmh->FMH_AllocatedSize > image_size - pos)
+			break;
+		if (fmh->FMH_AllocatedSize > BlockSize)
+			next = pos + fmh->FMH_AllocatedSize;
+	}
+
+	*nfmh = n;
+	return table;
+}
+
+static long long file_mtime_ns(struct stat *st)
+{
+	return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* Read the index of an image if it still describes it. The firmware
+ * information goes to FirmwareInfo, as it is in the image */
+static struct fmh_entry *load_index(const char *image_file, struct stat *st,
+				    long fmh_offset, int *nfmh)
+{
+	char name[PATH_MAX];
+	struct index_header hdr;
+	struct fmh_entry *table;
+	FILE *fd;
+
+	if (snprintf(name, sizeof(name), "%s%s", image_file, INDEX_SUFFIX) >= (int)sizeof(name))
+		return NULL;
+	fd = fopen(name, "r");
+	if (fd == NULL)
+		return NULL;
+
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1
+	    || memcmp(hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+	    || hdr.size != st->st_size || hdr.mtime != file_mtime_ns(st)
+	    || hdr.ino != st->st_ino || hdr.fmh_offset != fmh_offset
+	    || hdr.block_size != BlockSize || hdr.nfmh == 0 || hdr.nfmh > 0x10000
+	    || hdr.fwinfo_size > sizeof(FirmwareInfo) - 2)
+	{
+		fclose(fd);
+		return NULL;
+	}
+
+	table = malloc(hdr.nfmh * sizeof(struct fmh_entry));
+	if (table == NULL
+	    || fread(table, sizeof(struct fmh_entry), hdr.nfmh, fd) != hdr.nfmh
+	    || fread(FirmwareInfo, 1, hdr.fwinfo_size, fd) != hdr.fwinfo_size)
+	{
+		free(table);
+		fclose(fd);
+		return NULL;
+	}
+	fclose(fd);
+
+	FirmwareInfo[hdr.fwinfo_size] = 0xff;
+	FirmwareInfo[hdr.fwinfo_size + 1] = '\0';
+	Location = table[0].fmh.FMH_Location;
+	*nfmh = hdr.nfmh;
+	return table;
+}
+
+/* Keep the FMH table and the firmware information (up to its end, the
+ * first erased byte) next to the image. It is only a cache, so nothing
+ * is reported if it cannot be written */
+static void save_index(const char *image_file, struct stat *st, long fmh_offset,
+		       struct fmh_entry *table, int nfmh)
+{
+	char name[PATH_MAX], tmp[PATH_MAX + 16];
+	struct index_header hdr;
+	char *p;
+	FILE *fd;
+	int ok;
+
+	if (snprintf(name, sizeof(name), "%s%s", image_file, INDEX_SUFFIX) >= (int)sizeof(name))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, INDEX_MAGIC);
+	hdr.size = st->st_size;
+	hdr.mtime = file_mtime_ns(st);
+	hdr.ino = st->st_ino;
+	hdr.fmh_offset = fmh_offset;
+	hdr.block_size = BlockSize;
+	hdr.nfmh = nfmh;
+	p = index((char *)FirmwareInfo, 0xff);
+	hdr.fwinfo_size = (p != NULL) ? p - (char *)FirmwareInfo : 0;
+
+	fd = fopen(tmp, "w");
+	if (fd == NULL)
 		return;
+	ok = fwrite(&hdr, sizeof(hdr), 1, fd) == 1
+	     && fwrite(table, sizeof(struct fmh_entry), nfmh, fd) == (size_t)nfmh
+	     && fwrite(FirmwareInfo, 1, hdr.fwinfo_size, fd) == hdr.fwinfo_size;
+	if (fclose(fd) != 0 || !ok || rename(tmp, name) != 0)
+		unlink(tmp);
+}
+
+/* Read a stream (-i -, pipes) in one pass, one block at a time. Each FMH
+ * is parsed as its block arrives and the module data is written (and its
+ * crc32 calculated) as it goes by. Only the current and previous blocks,
+ * the FIRMWARE block and the FMH table are kept. Only the modules in
+ * names are written if there are any, and none for a summary. Returns 0,
+ * or 3 if the stream cannot be used */
+static int stream_image(FILE *in, long fmh_offset, char **names, int nnames,
+			const char *dir, struct stream_result *res)
+{
+	unsigned char *block[2] = { NULL, NULL }, *fw_block = NULL, *blk;
+	struct fmh_entry *table, *more;
+	struct dump_job *jobs = NULL, *job = NULL, *more_jobs;
+	int cur = 0, n = 1, max = 16, njobs = 0, k, status = 3;
+	int have_location = 0, ended = 0;
+	size_t pos, got, next_scan = 0, start, end, mod_start = 0, mod_end = 0;
+	UINT32 crc_done = 0, fw_prefix = 0, crc;
+	FMH *fmh;
+	FILE *out = NULL;
+	char outfile[256];
+
+	memset(res, 0, sizeof(struct stream_result));
+	if (fmh_offset % BlockSize != 0)
+	{
+		printf("Error: The FMH offset of a stream has to be on a block boundary\n");
+		return 3;
 	}
 
-	munmap(in_p, fmh->FMH_AllocatedSize);
+	table = malloc(max * sizeof(struct fmh_entry));
+	block[0] = malloc(BlockSize);
+	block[1] = malloc(BlockSize);
+	fw_block = malloc(BlockSize);
+	if (table == NULL || block[0] == NULL || block[1] == NULL || fw_block == NULL)
+	{
+		printf("Error: Out of memory\n");
+		goto out;
+	}
+
+	for (pos = 0; ; pos += BlockSize, cur ^= 1)
+	{
+		blk = block[cur];
+		got = fread(blk, 1, BlockSize, in);
+		if (got < (size_t)BlockSize)
+		{
+			res->size = pos + got;
+			break;
+		}
+
+		/* Image checksum of everything before this block */
+		if (verify && pos > 0 && (fmh_offset == 0 || pos <= (size_t)fmh_offset))
+			crc_done = CombineCRC32(crc_done, CalculateCRC32(block[cur ^ 1], BlockSize),
+						BlockSize);
+		if (fmh_offset != 0 && pos == (size_t)fmh_offset)
+		{
+			memcpy(fw_block, blk, BlockSize);
+			fw_prefix = crc_done;
+			fmh = ScanforFMH(fw_block, BlockSize);
+			if (fmh != NULL)
+			{
+				Location = fmh->FMH_Location;
+				have_location = 1;
+			}
+		}
 
-	fclose(out);
+		/* As in walk_image, the sections end at the FIRMWARE FMH. With -f
+		 * it is known by now, else it is the last block (see below) */
+		fmh = (pos >= next_scan && !ended) ? ScanforFMH(blk, BlockSize) : NULL;
+		if (fmh != NULL && have_location && fmh->FMH_Location == Location)
+		{
+			ended = 1;
+			fmh = NULL;
+		}
+		if (fmh != NULL)
+		{
+			if (job != NULL)
+			{
+				printf("Error: Module %s runs into the next section\n", job->name);
+				if (out != NULL && out != module_out)
+					fclose(out);
+				job = NULL;
+			}
+
+			if (n == max)
+			{
+				max *= 2;
+				more = realloc(table, max * sizeof(struct fmh_entry));
+				if (more == NULL)
+				{
+					printf("Error: Out of memory\n");
+					goto out;
+				}
+				table = more;
+			}
+			table[n].pos = pos;
+			memcpy(&table[n].fmh, fmh, sizeof(FMH));
+
+			/* Start writing the module */
+			for (k = 0; k < nnames; k++)
+			{
+				update_name(&fmh->Module_Info, outfile);
+				if (!strcasecmp(names[k], outfile))
+					break;
+			}
+			if ((!summary || verify) && fmh->Module_Info.Module_Type != MODULE_FMH_FIRMWARE
+			    && fmh->Module_Info.Module_Type != MODULE_FIRMWARE_1_4)
+			{
+				if (nnames == 0 || k < nnames)
+				{
+					more_jobs = realloc(jobs, (njobs + 1) * sizeof(struct dump_job));
+					if (more_jobs == NULL)
+					{
+						printf("Error: Out of memory\n");
+						goto out;
+					}
+					jobs = more_jobs;
+					job = &jobs[njobs++];
+					memset(job, 0, sizeof(struct dump_job));
+					job->entry = n;
+					job->status = 1;
+					update_name(&fmh->Module_Info, job->name);
+					mod_start = pos + fmh->Module_Info.Module_Location;
+					mod_end = mod_start + fmh->Module_Info.Module_Size;
+					if (!verify && nnames == 0)
+						printf(" -- processing %s...\n", job->name);
+					if (open_module(job->name, verify ? NULL : dir, &out, outfile) != 0)
+						job = NULL;
+					else
+					{
+						BeginCRC32(&job->crc);
+						if (out == module_out)
+						{
+							job->spool_pos = ftell(out);
+							job->spool_len = mod_end - mod_start;
+						}
+					}
+				}
+			}
+			n++;
+
+			// Skip the rest of the section
+			next_scan = pos + BlockSize;
+			if (fmh->FMH_AllocatedSize > BlockSize)
+				next_scan = pos + fmh->FMH_AllocatedSize;
+		}
+
+		/* The part of the module in this block */
+		if (job != NULL)
+		{
+			start = (mod_start > pos) ? mod_start : pos;
+			end = (mod_end < pos + BlockSize) ? mod_end : pos + BlockSize;
+			if (end > start)
+			{
+				UpdateCRC32(&job->crc, blk + start - pos, end - start);
+				if (out != NULL && fwrite(blk + start - pos, end - start, 1, out) != 1)
+				{
+					printf("Error: Unable to write to file %s\n", outfile);
+					if (out != module_out)
+						fclose(out);
+					job = NULL;
+				}
+			}
+			if (job != NULL && mod_end <= pos + BlockSize)
+			{
+				EndCRC32(&job->crc);
+				job->status = 0;
+				if (out != NULL && out != module_out && fclose(out) != 0)
+				{
+					printf("Error: Unable to write to file %s\n", outfile);
+					job->status = 1;
+				}
+				job = NULL;
+			}
+		}
+	}
+	if (ferror(in))
+	{
+		printf("Error: Read of the firmware stream failed\n");
+		goto out;
+	}
+	if (job != NULL)
+	{
+		printf("Error: Module %s is beyond the end of the image\n", job->name);
+		if (out != NULL && out != module_out)
+			fclose(out);
+	}
+
+	/* The FIRMWARE FMH is in the last block, unless -f tells where */
+	if (fmh_offset == 0 && pos > 0 && res->size == pos)
+	{
+		memcpy(fw_block, block[cur ^ 1], BlockSize);
+		fw_prefix = crc_done;
+	}
+	else if (fmh_offset == 0 || (size_t)fmh_offset >= pos)
+	{
+		printf("Error: The firmware stream does not end on a block boundary\n");
+		goto out;
+	}
+	fmh = ScanforFMH(fw_block, BlockSize);
+	if (fmh == NULL)
+	{
+		printf("Error: Can not find FMH header in the firmware stream\n");
+		goto out;
+	}
+	table[0].pos = (fmh_offset == 0) ? pos - BlockSize : (size_t)fmh_offset;
+	memcpy(&table[0].fmh, fmh, sizeof(FMH));
+	Location = fmh->FMH_Location;
+
+	/* dump_fwinfo tokenizes in place, so it gets a copy */
+	got = BlockSize - 0x40;
+	if (got > sizeof(FirmwareInfo) - 1)
+		got = sizeof(FirmwareInfo) - 1;
+	memcpy(FirmwareInfo, fw_block + 0x40, got);
+	FirmwareInfo[got] = '\0';
+
+	/* Same range as image_crc_pieces */
+	crc = fw_prefix;
+	crc = CombineCRC32(crc, CalculateCRC32(fw_block, FMH_FMH_HEADER_CHECKSUM_OFFSET),
+			   FMH_FMH_HEADER_CHECKSUM_OFFSET);
+	crc = CombineCRC32(crc, CalculateCRC32(fw_block + FMH_FMH_HEADER_CHECKSUM_OFFSET + 1,
+			   FMH_MODULE_CHECKSUM_START_OFFSET - FMH_FMH_HEADER_CHECKSUM_OFFSET - 1),
+			   FMH_MODULE_CHECKSUM_START_OFFSET - FMH_FMH_HEADER_CHECKSUM_OFFSET - 1);
+	crc = CombineCRC32(crc, CalculateCRC32(fw_block + FMH_MODULE_CHCKSUM_END_OFFSET + 1,
+			   BlockSize - FMH_MODULE_CHCKSUM_END_OFFSET - 1),
+			   BlockSize - FMH_MODULE_CHCKSUM_END_OFFSET - 1);
+	res->image_crc = crc;
+
+	// Sections end where the FIRMWARE one is
+	for (k = 1; k < n; k++)
+	{
+		if (table[k].fmh.FMH_Location == Location)
+			break;
+	}
+	n = k;
+	for (k = 0; k < njobs && jobs[k].entry < n; k++)
+		jobs[k].mod = &table[jobs[k].entry].fmh.Module_Info;
+
+	res->table = table;
+	res->nfmh = n;
+	res->jobs = jobs;
+	res->njobs = k;
+	table = NULL;
+	jobs = NULL;
+	status = 0;
+out:
+	free(table);
+	free(jobs);
+	free(block[0]);
+	free(block[1]);
+	free(fw_block);
+	return status;
+}
+
+/* Copy a module from the spool file to module_dest */
+static int copy_spooled(struct dump_job *job)
+{
+	unsigned char buf[0x10000];
+	size_t done, len;
+
+	if (fseek(module_out, job->spool_pos, SEEK_SET) != 0)
+		return 1;
+	for (done = 0; done < job->spool_len; done += len)
+	{
+		len = job->spool_len - done;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		if (fread(buf, len, 1, module_out) != 1 || fwrite(buf, len, 1, module_dest) != 1)
+			return 1;
+	}
+	return 0;
+}
+
+/* -m on a stream: the modules were written as they went by, or spooled
+ * when several go to standard output */
+static int report_stream_modules(char **names, int nnames, struct dump_job *jobs, int njobs)
+{
+	int j, k, bad = 0;
+
+	if (module_dest != NULL)
+		fflush(module_out);
+
+	for (k = 0; k < nnames; k++)
+	{
+		for (j = 0; j < njobs; j++)
+		{
+			if (!strcasecmp(names[k], jobs[j].name))
+				break;
+		}
+		if (j == njobs)
+		{
+			printf("Error: No module %s in the image\n", names[k]);
+			bad++;
+		}
+		else if (module_dest != NULL && jobs[j].status == 0 && copy_spooled(&jobs[j]) != 0)
+		{
+			printf("Error: Unable to write to standard output\n");
+			bad++;
+		}
+	}
+	if (module_dest != NULL)
+		fflush(module_dest);
+	else if (module_out != NULL)
+		fflush(module_out);
+	if (report_modules(jobs, njobs) != 0)
+		bad++;
+	return bad ? 4 : 0;
+}
+
+/* Extract only the named modules (-m), found in the FMH table of the
+ * image. Modules are written in the order they are named. Returns the
+ * exit status */
+static int extract_modules(unsigned char *image, size_t image_size, struct fmh_entry *table,
+			   int nfmh, char **names, int nnames, const char *dir, int nthreads)
+{
+	struct dump_job *jobs;
+	char name[9];
+	int i, k, n, bad = 0;
+
+	jobs = calloc(nnames, sizeof(struct dump_job));
+	if (jobs == NULL)
+	{
+		printf("Error: Out of memory\n");
+		return 3;
+	}
+
+	for (k = n = 0; k < nnames; k++)
+	{
+		for (i = 1; i < nfmh; i++)
+		{
+			update_name(&table[i].fmh.Module_Info, name);
+			if (!strcasecmp(names[k], name))
+				break;
+		}
+		if (i == nfmh)
+		{
+			printf("Error: No module %s in the image\n", names[k]);
+			bad++;
+			continue;
+		}
+		jobs[n].mod = &table[i].fmh.Module_Info;
+		strcpy(jobs[n].name, name);
+		jobs[n].sec = image + table[i].pos;
+		jobs[n].avail = image_size - table[i].pos;
+		n++;
+	}
+
+	/* One after the other when they all go to the same stream */
+	if (module_out != NULL)
+		nthreads = 1;
+	run_dump_jobs(jobs, n, NULL, 0, nthreads - 1, dir);
+	if (module_out != NULL)
+		fflush(module_out);
+	if (report_modules(jobs, n) != 0)
+		bad++;
+	free(jobs);
+	return bad ? 4 : 0;
 }
 
 static
@@ -225,11 +964,18 @@ Usage(char *Prog, int status)
 {
 	printf("Usage is %s <Args>\n", Prog);
 	printf("Args are :\n");
-	printf("\t -i Input Firmware File\n");
+	printf("\t -i Input Firmware File (- for stdin, read in one pass)\n");
 	printf("\t -o Output Firmware Path\n");
 	printf("\t -b Block Size (in kB, default 64)\n");
 	printf("\t -s Summary\n");
 	printf("\t -f Offset to the FMH header\n");
+	printf("\t -j Number of modules to extract in parallel, then check their\n");
+	printf("\t    checksums (exit status 4 if one is wrong)\n");
+	printf("\t -V Verify the FMHs, module checksums and image checksum only\n");
+	printf("\t    (exit status 4 if the image is damaged)\n");
+	printf("\t -m Extract only these modules (NAME[,NAME...]), to stdout without -o\n");
+	printf("\t    in the order they are named\n");
+	printf("\t -n Do not use the FMH index kept next to the image (-s, -m)\n");
 	printf("\n");
 	exit(status);
 }
@@ -239,10 +985,17 @@ main(int argc, char *argv[])
 {
 	int opt;
 	long fmh_offset = 0;
+	int nthreads = 1;
+	int check = 0;			/* -j: report the module checksums */
+	int status = 0;
+	int j, bad = 0;
 
 	/* Global Information */	
 	char *OutDir;			/* Location of Output Files */
 	char *fw_file;
+	char *modules = NULL;		/* Modules to extract (-m) */
+	char *names[64], *tok;
+	int nnames = 0;
 
 	/* Output File Creation Related */	
 	FILE *Outfd;			/* Output File Descriptor */
@@ -250,9 +1003,21 @@ main(int argc, char *argv[])
 
 	/* FMH Related */
 	FILE *Infd;
+	unsigned char *Image;		/* Whole firmware file, mapped read only */
+	size_t ImageSize;
+	size_t Pos, Next;
 	FMH *fmh = NULL;
 	MODULE_INFO *mod = NULL;	/* Module Information */
 	char ModuleName[9];
+	struct fmh_entry *table = NULL;	/* FIRMWARE FMH, then the sections */
+	int nfmh = 0, use_index, i;
+	struct stream_result res;
+	int stream, have_fw;
+	struct dump_job *jobs = NULL, *job;
+	int njobs = 0;
+	struct crc_piece *pieces = NULL;
+	int npieces = 0;
+	UINT32 image_crc;
 
 	/* RACTRENDS releted */
 //	int FirmwareMajor,FirmwareMinor;
@@ -264,7 +1029,7 @@ main(int argc, char *argv[])
 	ini_name[0] = '\0';
 	BlockSize = 0;
 
-	while ((opt = getopt(argc, argv, "i:o:b:f:hs")) != -1)
+	while ((opt = getopt(argc, argv, "i:o:b:f:j:m:hnsV")) != -1)
 	{
 		 switch (opt)
 		 {
@@ -283,16 +1048,52 @@ main(int argc, char *argv[])
 			case 's':
 				summary = 1;
 				break;
+			case 'V':
+				verify = 1;
+				break;
+			case 'n':
+				noindex = 1;
+				break;
+			case 'm':
+				modules = strdup(optarg);
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				if (nthreads < 1)
+					nthreads = 1;
+				check = 1;
+				break;
 			default:
 				Usage("dumpimage", opt != 'h');
 				break;
 		}
 	}
 
-	if (fw_file == NULL || (OutDir == NULL && !summary))
+	if (fw_file == NULL || (OutDir == NULL && !summary && !verify && modules == NULL))
 		Usage("dumpimage", 2);
 
-	if (!summary)
+	if (modules != NULL)
+	{
+		for (tok = strtok(modules, ","); tok != NULL && nnames < 64; tok = strtok(NULL, ","))
+			names[nnames++] = tok;
+		if (nnames == 0)
+			Usage("dumpimage", 2);
+		summary = verify = 0;
+	}
+
+	/* Verify shows the summary and writes nothing */
+	if (verify)
+		summary = 1;
+
+	if (modules != NULL && OutDir != NULL)
+	{
+		if (mkdir(OutDir, 0755) < 0 && errno != EEXIST)
+		{
+			perror("Error: Unable to create directory");
+			return 3;
+		}
+	}
+	else if (!summary && modules == NULL)
 	{
 		snprintf(ini_name, 256, "%s/genimage.ini", OutDir);
 
@@ -306,7 +1107,22 @@ main(int argc, char *argv[])
 	if (BlockSize == 0)
 		BlockSize = 0x10 * 0x1000;
 
-	Infd = fopen(fw_file, "r");
+	/* -m without -o keeps stdout for the module data only */
+	if (modules != NULL && OutDir == NULL)
+	{
+		fflush(stdout);
+		module_out = fdopen(dup(fileno(stdout)), "w");
+		if (module_out == NULL || dup2(fileno(stderr), fileno(stdout)) < 0)
+		{
+			printf("Error: Unable to write to standard output\n");
+			return 3;
+		}
+	}
+
+	if (!strcmp(fw_file, "-"))
+		Infd = stdin;
+	else
+		Infd = fopen(fw_file, "r");
 	if (Infd == NULL)
 	{
 		printf("Error: Unable to open firmware file %s\n", fw_file);
@@ -319,31 +1135,113 @@ main(int argc, char *argv[])
 		return 3;
 	}
 
-	if (fmh_offset == 0)
+	/* Anything but a file is read once, as it comes */
+	stream = !S_ISREG(stat.st_mode);
+
+	/* A stream has the modules in image order. Several of them for
+	 * standard output are spooled to keep the order they are named in */
+	if (stream && module_out != NULL && nnames > 1)
+	{
+		module_dest = module_out;
+		module_out = tmpfile();
+		if (module_out == NULL)
+		{
+			printf("Error: Unable to create a temporary file\n");
+			return 3;
+		}
+	}
+
+	/* A summary, or the modules to extract, can be found from the index */
+	use_index = !noindex && !verify && !stream && strcmp(fw_file, "-")
+		    && (summary || modules != NULL);
+	if (use_index)
+		table = load_index(fw_file, &stat, fmh_offset, &nfmh);
+
+	/* Everything below reads the image through one mapping. A summary
+	 * from the index does not need it */
+	ImageSize = stat.st_size;
+	Image = NULL;
+	if (stream)
 	{
-		if (fseek(Infd, -BlockSize, SEEK_END) < 0)
+		if (stream_image(Infd, fmh_offset, names, nnames, OutDir, &res) != 0)
+			return 3;
+		table = res.table;
+		nfmh = res.nfmh;
+		jobs = res.jobs;
+		njobs = res.njobs;
+		ImageSize = res.size;
+	}
+	else if (table == NULL || !summary)
+	{
+		if (ImageSize < (size_t)BlockSize)
 		{
-			printf("Error: Seek to the end of firmware file %s failed\n", fw_file);
+			printf("Error: Firmware file %s is smaller than a block\n", fw_file);
 			return 3;
 		}
-	} else {
-		if (fseek(Infd, fmh_offset, SEEK_SET) < 0)
+		Image = mmap(NULL, ImageSize, PROT_READ, MAP_SHARED, fileno(Infd), 0);
+		if (Image == MAP_FAILED)
 		{
-			printf("Error: Seek to the specified FMH offset in %s failed\n", fw_file);
+			printf("Error: Unable to map firmware file %s\n", fw_file);
 			return 3;
 		}
+		madvise(Image, ImageSize, MADV_SEQUENTIAL);
+		madvise(Image, ImageSize, MADV_WILLNEED);
 	}
 
-	if (fread(FirmwareInfo, BlockSize, 1, Infd) != 1) {
-		printf("Error: Read of firmware file %s failed\n", fw_file);
-		return 3;
+	if (table == NULL)
+	{
+		if (fmh_offset == 0)
+			Pos = ImageSize - BlockSize;
+		else if (fmh_offset > 0 && (size_t)fmh_offset <= ImageSize - BlockSize)
+			Pos = fmh_offset;
+		else
+		{
+			printf("Error: FMH offset is beyond the end of %s\n", fw_file);
+			return 3;
+		}
+
+		fmh = ScanforFMH(Image + Pos, BlockSize);
+		if (fmh == NULL)
+		{
+			printf("Error: Can not find FMH header in %s\n", fw_file);
+			return 3;
+		}
+
+		/* dump_fwinfo tokenizes in place, so it gets a copy */
+		Next = BlockSize - 0x40;
+		if (Next > sizeof(FirmwareInfo) - 1)
+			Next = sizeof(FirmwareInfo) - 1;
+		memcpy(FirmwareInfo, Image + Pos + 0x40, Next);
+		FirmwareInfo[Next] = '\0';
+
+		table = walk_image(Image, ImageSize, fmh, Pos, &nfmh, &bad);
+		if (table == NULL)
+		{
+			printf("Error: Out of memory\n");
+			return 3;
+		}
+		if (use_index)
+			save_index(fw_file, &stat, fmh_offset, table, nfmh);
 	}
 
-	fmh = ScanforFMH(FirmwareInfo, BlockSize);
-	if (fmh == NULL)
+	/* Only some modules, and nothing about the image */
+	if (modules != NULL)
 	{
-		printf("Error: Can not find FMH header in %s\n", fw_file);
-		return 3;
+		if (stream)
+			status = report_stream_modules(names, nnames, jobs, njobs);
+		else
+			status = extract_modules(Image, ImageSize, table, nfmh, names, nnames,
+						 OutDir, nthreads);
+		if (module_out != NULL)
+			fclose(module_out);
+		if (module_dest != NULL)
+			fclose(module_dest);
+		free(jobs);
+		free(table);
+		if (Image != NULL)
+			munmap(Image, ImageSize);
+		fclose(Infd);
+		return status;
 	}
 
 	if (!summary)
@@ -360,18 +1258,18 @@ main(int argc, char *argv[])
 		Outfd = stdout;
 	}
 
+	fmh = &table[0].fmh;
 	mod = &(fmh->Module_Info);
 	update_name(mod, ModuleName);
 
-	Location = fmh->FMH_Location;
-
 	if (!summary)
 	{
 		fprintf(Outfd, "[GLOBAL]\n\tOutput  \t= %s\n\tFlashSize \t= %dM\n\tBlockSize\t= %dK\n",
-			basename(fw_file), stat.st_size / 0x100000, BlockSize / 1024);
+			stream ? "firmware.ima" : basename(fw_file), ImageSize / 0x100000,
+			BlockSize / 1024);
 	}
 
-	dump_fwinfo((char *)FirmwareInfo+0x40, Outfd);
+	dump_fwinfo((char *)FirmwareInfo, Outfd);
 
 	if (!summary)
 		fputs("\n", Outfd);
@@ -386,35 +1284,104 @@ main(int argc, char *argv[])
 	printf("FW %d.%d\n", FirmwareMajor, FirmwareMinor);
 	printf("Size %08x Location %08x\n", fmh->FMH_Size, fmh->FMH_Location);
 #endif
-	fseek(Infd, 0, SEEK_SET);
-
-	while (fread(FirmwareInfo, BlockSize, 1, Infd) == 1)
+	for (i = 1; i < nfmh; i++)
 	{
-		fmh = ScanforFMH(FirmwareInfo, BlockSize);
-		if (fmh == NULL)
-		{
-			// Possible GAP, try next block
-			continue;
-		}
-
-		// Last block reached, stop
-		if (fmh->FMH_Location == Location)
-			break;
-
+		fmh = &table[i].fmh;
 		mod = &(fmh->Module_Info);
 		update_name(mod, ModuleName);
 
 		dump_fmh(fmh, mod, ModuleName, Outfd);
-		if (!summary)
-			dump_module(fmh, mod, ModuleName, Infd, OutDir);
 
-		fseek(Infd, fmh->FMH_AllocatedSize - BlockSize, SEEK_CUR);
+		/* Queue the module, it is extracted (or verified) once all
+		 * the FMHs are shown. A stream has done it already */
+		if (!stream && (!summary || verify) && mod->Module_Type != MODULE_FMH_FIRMWARE
+		    && mod->Module_Type != MODULE_FIRMWARE_1_4)
+		{
+			if (jobs == NULL)
+			{
+				jobs = malloc(nfmh * sizeof(struct dump_job));
+				if (jobs == NULL)
+				{
+					printf("Error: Out of memory\n");
+					return 3;
+				}
+			}
+			job = &jobs[njobs++];
+			memset(job, 0, sizeof(struct dump_job));
+			job->mod = mod;
+			strcpy(job->name, ModuleName);
+			job->sec = Image + table[i].pos;
+			job->avail = ImageSize - table[i].pos;
+			if (!verify)
+				printf(" -- processing %s...\n", ModuleName);
+		}
 	}
 
+	/* The image checksum is calculated in pieces along with the modules */
+	fmh = &table[0].fmh;
+	have_fw = fmh->Module_Info.Module_Type == MODULE_FMH_FIRMWARE
+		  || fmh->Module_Info.Module_Type == MODULE_FIRMWARE_1_4;
+	if (verify && have_fw && !stream)
+	{
+		pieces = image_crc_pieces(Image, table[0].pos, &npieces);
+		if (pieces == NULL)
+		{
+			printf("Error: Out of memory\n");
+			return 3;
+		}
+	}
+
+	/* Extract (or verify) the modules and check them */
+	if (verify)
+		OutDir = NULL;
+	if (!stream && (njobs > 0 || npieces > 0))
+	{
+		/* The main thread is one of the nthreads */
+		run_dump_jobs(jobs, njobs, pieces, npieces, nthreads - 1, OutDir);
+	}
+	/* A plain extraction stays as it was: no report, and exit status 0 */
+	if (njobs > 0 && (verify || check))
+		bad += report_modules(jobs, njobs);
+	free(jobs);
+
+	if (verify)
+	{
+		if (!have_fw)
+			printf("Image checksum :\tNO FIRMWARE MODULE\n");
+		else
+		{
+			if (stream)
+				image_crc = res.image_crc;
+			else
+			{
+				image_crc = 0;
+				for (j = 0; j < npieces; j++)
+					image_crc = CombineCRC32(image_crc, pieces[j].crc,
+								 pieces[j].len);
+			}
+			if (image_crc == le32_to_host(fmh->Module_Info.Module_Checksum))
+				printf("Image checksum :\tOK\n");
+			else
+			{
+				printf("Image checksum :\tMISMATCH (FMH 0x%08x, image 0x%08x)\n",
+					le32_to_host(fmh->Module_Info.Module_Checksum), image_crc);
+				bad++;
+			}
+		}
+		printf("%s is %s\n", fw_file, bad ? "DAMAGED" : "intact");
+	}
+	free(pieces);
+	free(table);
+
+	if (bad)
+		status = 4;
+
+	if (Image != NULL)
+		munmap(Image, ImageSize);
 	fclose(Infd);
 
 	if (!summary)
 		fclose(Outfd);
 
-	return 0;
+	return status;
 }
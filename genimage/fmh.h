@@ -134,5 +134,9 @@ void 	CreateAlternateFMH(ALT_FMH *altfmh,UINT32 FMH_Offset);
 UINT32 CalculateCRC32(unsigned char *Buffer, UINT32 Size);
 void BeginCRC32(UINT32 *crc32);
 void DoCRC32(UINT32 *crc32, unsigned char Data);
+void UpdateCRC32(UINT32 *crc32, unsigned char *Buffer, UINT32 Size);
 void EndCRC32(UINT32 *crc32);
+UINT32 CombineCRC32(UINT32 crc1, UINT32 crc2, UINT32 Len2);
+UINT32 FillCRC32(unsigned char Data, UINT32 Size);
+int SelfTestCRC32(void);
 #endif	
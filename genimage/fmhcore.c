@@ -8,10 +8,18 @@
 #else
 	#include <stdio.h>
 	#include <string.h>
+	#include <pthread.h>
 #endif
 #include "fmh.h"
 #include "crc32.h"
 
+/* Carry-less multiply CRC32 kernels are only built for x86 user space */
+#if defined(__GNUC__) && !defined(__KERNEL__) && \
+	(defined(__i386__) || defined(__x86_64__))
+	#define CRC32_FOLD_X86	1
+	#include <immintrin.h>
+#endif
+
 
 unsigned char  CalculateModule100(unsigned char *Buffer, UINT32 Size);
 static FMH * CheckForNormalFMH(FMH *fmh);
@@ -152,16 +160,513 @@ CreateAlternateFMH(ALT_FMH *altfmh,UINT32 FMH_Offset)
 
 
 
+/* Slicing tables: CrcSliceTable[k][n] is the CRC of byte n followed by k
+ * zero bytes. Row 0 is CrcLookUpTable, the rest are derived on first use */
+#define CRC32_SLICES	16
+
+static UINT32 CrcSliceTable[CRC32_SLICES][256];
+static int CrcSliceReady = 0;
+#ifndef __KERNEL__
+static pthread_once_t CrcSliceOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static void SelectCRC32Kernel(void);
+
+static
+void
+InitCRC32Tables(void)
+{
+	UINT32 i,k,crc32;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc32 = CrcLookUpTable[i];
+		CrcSliceTable[0][i] = crc32;
+		for (k = 1; k < CRC32_SLICES; k++)
+		{
+			crc32 = (crc32 >> 8) ^ CrcLookUpTable[crc32 & 0x000000FF];
+			CrcSliceTable[k][i] = crc32;
+		}
+	}
+	SelectCRC32Kernel();
+	CrcSliceReady = 1;
+	return;
+}
+
+/* The first crc32 may be taken by several worker threads at once (-j),
+ * user space builds the tables and picks the kernel under pthread_once */
+static
+void
+ReadyCRC32Tables(void)
+{
+#ifdef __KERNEL__
+	if (!CrcSliceReady)
+		InitCRC32Tables();
+#else
+	pthread_once(&CrcSliceOnce,InitCRC32Tables);
+#endif
+	return;
+}
+
+/* Fold the running crc into the next four bytes (little endian order) */
+#define CRC32_WORD(crc,p)	((crc) ^ ((UINT32)(p)[0] | ((UINT32)(p)[1] << 8) | \
+				((UINT32)(p)[2] << 16) | ((UINT32)(p)[3] << 24)))
+
+#define CRC32_SLICE4(t,w)	(CrcSliceTable[(t)+3][(w) & 0xFF] ^ \
+				 CrcSliceTable[(t)+2][((w) >> 8) & 0xFF] ^ \
+				 CrcSliceTable[(t)+1][((w) >> 16) & 0xFF] ^ \
+				 CrcSliceTable[(t)][((w) >> 24) & 0xFF])
+
+static
+UINT32
+Slice16CRC32(UINT32 crc32, unsigned char *Buffer, UINT32 Size)
+{
+	UINT32 w0,w1,w2,w3;
+
+	while (Size >= 16)
+	{
+		w0 = CRC32_WORD(crc32,Buffer);
+		w1 = CRC32_WORD(0,Buffer+4);
+		w2 = CRC32_WORD(0,Buffer+8);
+		w3 = CRC32_WORD(0,Buffer+12);
+		crc32 = CRC32_SLICE4(12,w0) ^ CRC32_SLICE4(8,w1) ^
+				CRC32_SLICE4(4,w2) ^ CRC32_SLICE4(0,w3);
+		Buffer += 16;
+		Size -= 16;
+	}
+
+	if (Size >= 8)
+	{
+		w0 = CRC32_WORD(crc32,Buffer);
+		w1 = CRC32_WORD(0,Buffer+4);
+		crc32 = CRC32_SLICE4(4,w0) ^ CRC32_SLICE4(0,w1);
+		Buffer += 8;
+		Size -= 8;
+	}
+
+	while (Size--)
+	{
+		crc32 = (crc32 >> 8) ^ CrcLookUpTable[(*Buffer) ^ (crc32 & 0x000000FF)];
+		Buffer++;
+	}
+	return crc32;
+}
+
+#ifdef CRC32_FOLD_X86
+/* Folding constants for the reflected CRC32 polynomial, as described in
+ * Intel's "Fast CRC Computation Using PCLMULQDQ Instruction". Each pair is
+ * x^(D+32) and x^(D-32) mod P (bit reflected) to fold D bits forward */
+#define CRC32_K2048	0x011542778aULL, 0x01322d1430ULL
+#define CRC32_K512	0x0154442bd4ULL, 0x01c6e41596ULL
+#define CRC32_K384	0x003db1ecdcULL, 0x0174359406ULL
+#define CRC32_K256	0x00f1da05aaULL, 0x015a546366ULL
+#define CRC32_K128	0x01751997d0ULL, 0x00ccaa009eULL
+#define CRC32_K64	0x0163cd6124ULL
+#define CRC32_POLY	0x01db710641ULL, 0x01f7011641ULL
+
+/* Smallest buffer handed to a folding kernel */
+#define CRC32_FOLD_MIN	256
+
+#define CRC32_FOLD_TARGET	__attribute__ ((target ("pclmul,sse4.1")))
+#define CRC32_FOLD512_TARGET	__attribute__ ((target ("pclmul,sse4.1,avx512f,vpclmulqdq")))
+
+static CRC32_FOLD_TARGET
+__m128i
+Const128(unsigned long long Lo, unsigned long long Hi)
+{
+	return _mm_set_epi64x(Hi,Lo);
+}
+
+static CRC32_FOLD_TARGET
+__m128i
+Fold128(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),
+				_mm_clmulepi64_si128(x,k,0x11)),data);
+}
+
+/* Fold the remaining 16 byte blocks into x and Barrett reduce to 32 bits */
+static CRC32_FOLD_TARGET
+UINT32
+ReduceFold128(__m128i x1, unsigned char *Buffer, UINT32 Size)
+{
+	__m128i x0,x2,x3;
+
+	x0 = Const128(CRC32_K128);
+	while (Size >= 16)
+	{
+		x1 = Fold128(x1,x0,_mm_loadu_si128((__m128i *)Buffer));
+		Buffer += 16;
+		Size -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1,x0,0x10);
+	x3 = _mm_setr_epi32(~0,0,~0,0);
+	x1 = _mm_srli_si128(x1,8);
+	x1 = _mm_xor_si128(x1,x2);
+
+	x0 = Const128(CRC32_K64,0);
+	x2 = _mm_srli_si128(x1,4);
+	x1 = _mm_and_si128(x1,x3);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = Const128(CRC32_POLY);
+	x2 = _mm_and_si128(x1,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x10);
+	x2 = _mm_and_si128(x2,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	return (UINT32)_mm_extract_epi32(x1,1);
+}
+
+/* PCLMULQDQ kernel: Size must be at least 64 and a multiple of 16 */
+static CRC32_FOLD_TARGET
+UINT32
+Fold128CRC32(UINT32 crc32, unsigned char *Buffer, UINT32 Size)
+{
+	__m128i x0,x1,x2,x3,x4;
+
+	x1 = _mm_loadu_si128((__m128i *)(Buffer + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(Buffer + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(Buffer + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(Buffer + 0x30));
+	x1 = _mm_xor_si128(x1,_mm_cvtsi32_si128(crc32));
+	Buffer += 64;
+	Size -= 64;
+
+	/* Fold four lanes in parallel, 64 bytes per round */
+	x0 = Const128(CRC32_K512);
+	while (Size >= 64)
+	{
+		x1 = Fold128(x1,x0,_mm_loadu_si128((__m128i *)(Buffer + 0x00)));
+		x2 = Fold128(x2,x0,_mm_loadu_si128((__m128i *)(Buffer + 0x10)));
+		x3 = Fold128(x3,x0,_mm_loadu_si128((__m128i *)(Buffer + 0x20)));
+		x4 = Fold128(x4,x0,_mm_loadu_si128((__m128i *)(Buffer + 0x30)));
+		Buffer += 64;
+		Size -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = Const128(CRC32_K128);
+	x1 = Fold128(x1,x0,x2);
+	x1 = Fold128(x1,x0,x3);
+	x1 = Fold128(x1,x0,x4);
+
+	return ReduceFold128(x1,Buffer,Size);
+}
+
+static CRC32_FOLD512_TARGET
+__m512i
+Fold512(__m512i x, __m512i k, __m512i data)
+{
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x,k,0x00),
+				_mm512_clmulepi64_epi128(x,k,0x11),data,0x96);
+}
+
+static CRC32_FOLD512_TARGET
+__m512i
+Broadcast512(unsigned long long Lo, unsigned long long Hi)
+{
+	return _mm512_broadcast_i32x4(_mm_set_epi64x(Hi,Lo));
+}
+
+/* AVX-512 VPCLMULQDQ kernel: Size must be at least 256 and a multiple of 16 */
+static CRC32_FOLD512_TARGET
+UINT32
+Fold512CRC32(UINT32 crc32, unsigned char *Buffer, UINT32 Size)
+{
+	__m512i z0,z1,z2,z3,z4;
+	__m128i x0,x1;
+
+	z1 = _mm512_loadu_si512((void *)(Buffer + 0x00));
+	z2 = _mm512_loadu_si512((void *)(Buffer + 0x40));
+	z3 = _mm512_loadu_si512((void *)(Buffer + 0x80));
+	z4 = _mm512_loadu_si512((void *)(Buffer + 0xC0));
+	z1 = _mm512_xor_si512(z1,_mm512_castsi128_si512(_mm_cvtsi32_si128(crc32)));
+	Buffer += 256;
+	Size -= 256;
+
+	/* Fold four 512 bit lanes in parallel, 256 bytes per round */
+	z0 = Broadcast512(CRC32_K2048);
+	while (Size >= 256)
+	{
+		z1 = Fold512(z1,z0,_mm512_loadu_si512((void *)(Buffer + 0x00)));
+		z2 = Fold512(z2,z0,_mm512_loadu_si512((void *)(Buffer + 0x40)));
+		z3 = Fold512(z3,z0,_mm512_loadu_si512((void *)(Buffer + 0x80)));
+		z4 = Fold512(z4,z0,_mm512_loadu_si512((void *)(Buffer + 0xC0)));
+		Buffer += 256;
+		Size -= 256;
+	}
+
+	/* Fold the four lanes into one, then any remaining 64 byte blocks */
+	z0 = Broadcast512(CRC32_K512);
+	z1 = Fold512(z1,z0,z2);
+	z1 = Fold512(z1,z0,z3);
+	z1 = Fold512(z1,z0,z4);
+	while (Size >= 64)
+	{
+		z1 = Fold512(z1,z0,_mm512_loadu_si512((void *)Buffer));
+		Buffer += 64;
+		Size -= 64;
+	}
+
+	/* Fold the four 128 bit parts of the lane into one */
+	x0 = Const128(CRC32_K384);
+	x1 = Fold128(_mm512_extracti32x4_epi32(z1,0),x0,
+					_mm512_extracti32x4_epi32(z1,3));
+	x0 = Const128(CRC32_K256);
+	x1 = Fold128(_mm512_extracti32x4_epi32(z1,1),x0,x1);
+	x0 = Const128(CRC32_K128);
+	x1 = Fold128(_mm512_extracti32x4_epi32(z1,2),x0,x1);
+
+	return ReduceFold128(x1,Buffer,Size);
+}
+#endif
+
+/* Kernel used by UpdateCRC32 for bulk data, NULL for table only */
+typedef UINT32 (*CRC32_KERNEL)(UINT32 crc32, unsigned char *Buffer, UINT32 Size);
+static CRC32_KERNEL FoldCRC32 = NULL;
+
+/* Body of UpdateCRC32: bulk data through the kernel, the tail and short
+ * buffers through the tables */
+static
+UINT32
+KernelCRC32(CRC32_KERNEL Kernel, UINT32 crc32, unsigned char *Buffer, UINT32 Size)
+{
+#ifdef CRC32_FOLD_X86
+	if ((Kernel != NULL) && (Size >= CRC32_FOLD_MIN))
+	{
+		crc32 = Kernel(crc32,Buffer,Size & ~0xF);
+		Buffer += Size & ~0xF;
+		Size &= 0xF;
+	}
+#endif
+	return Slice16CRC32(crc32,Buffer,Size);
+}
+
+#ifdef CRC32_FOLD_X86
+/* Check a kernel the way UpdateCRC32 uses it against the byte at a time
+ * crc32, on unaligned buffers of any length, each split in two updates.
+ * Returns the number of mismatches */
+static
+int
+TestCRC32Kernel(CRC32_KERNEL Kernel)
+{
+	unsigned char Buffer[4096+64];
+	UINT32 Seed = 0x2545F491;
+	UINT32 i,j,Offset,Size,Split,Expect,crc32;
+	int Errors = 0;
+
+	for (i = 0; i < sizeof(Buffer); i++)
+	{
+		Seed ^= Seed << 13;
+		Seed ^= Seed >> 17;
+		Seed ^= Seed << 5;
+		Buffer[i] = (unsigned char)Seed;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		Seed ^= Seed << 13;
+		Seed ^= Seed >> 17;
+		Seed ^= Seed << 5;
+		Offset = Seed & 0x3F;
+		Size = (Seed >> 6) % 4097;
+		Split = (Seed >> 19) % (Size + 1);
+
+		BeginCRC32(&Expect);
+		for (j = 0; j < Size; j++)
+			DoCRC32(&Expect,Buffer[Offset+j]);
+		EndCRC32(&Expect);
+
+		BeginCRC32(&crc32);
+		crc32 = KernelCRC32(Kernel,crc32,Buffer+Offset,Split);
+		crc32 = KernelCRC32(Kernel,crc32,Buffer+Offset+Split,Size-Split);
+		EndCRC32(&crc32);
+		if (crc32 != Expect)
+			Errors++;
+	}
+	return Errors;
+}
+#endif
+
+/* Pick the fastest CRC32 kernel the CPU supports and passes the self test */
+static
+void
+SelectCRC32Kernel(void)
+{
+#ifdef CRC32_FOLD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	{
+		if (__builtin_cpu_supports("avx512f") &&
+		    __builtin_cpu_supports("vpclmulqdq"))
+		{
+			if (TestCRC32Kernel(Fold512CRC32) == 0)
+			{
+				FoldCRC32 = Fold512CRC32;
+				return;
+			}
+			fprintf(stderr,"WARNING: VPCLMULQDQ CRC32 kernel failed its self test, not used\n");
+		}
+		if (TestCRC32Kernel(Fold128CRC32) == 0)
+			FoldCRC32 = Fold128CRC32;
+		else
+			fprintf(stderr,"WARNING: PCLMULQDQ CRC32 kernel failed its self test, not used\n");
+	}
+#endif
+	return;
+}
+
+int
+SelfTestCRC32(void)
+{
+	int Errors = 0;
+
+	ReadyCRC32Tables();
+
+#ifdef CRC32_FOLD_X86
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	{
+		Errors += TestCRC32Kernel(Fold128CRC32);
+		if (__builtin_cpu_supports("avx512f") &&
+		    __builtin_cpu_supports("vpclmulqdq"))
+			Errors += TestCRC32Kernel(Fold512CRC32);
+	}
+#endif
+	return Errors;
+}
+
+/* Operators that advance a crc32 register over 2^k zero bytes, as 32x32
+ * GF(2) matrices (one column per word). Built on first use, like zlib's
+ * crc32_combine, but squared only once */
+static UINT32 CrcShiftMatrix[32][32];
+static int CrcShiftReady = 0;
+#ifndef __KERNEL__
+static pthread_once_t CrcShiftOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static
+UINT32
+GF2MatrixTimes(UINT32 *Mat, UINT32 Vec)
+{
+	UINT32 Sum = 0;
+
+	while (Vec)
+	{
+		if (Vec & 1)
+			Sum ^= *Mat;
+		Vec >>= 1;
+		Mat++;
+	}
+	return Sum;
+}
+
+static
+void
+GF2MatrixSquare(UINT32 *Square, UINT32 *Mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		Square[n] = GF2MatrixTimes(Mat,Mat[n]);
+	return;
+}
+
+static
+void
+InitCRC32Shift(void)
+{
+	UINT32 Odd[32],Even[32];
+	UINT32 Row;
+	int n;
+
+	/* Operator for one zero bit */
+	Odd[0] = 0xEDB88320;
+	Row = 1;
+	for (n = 1; n < 32; n++)
+	{
+		Odd[n] = Row;
+		Row <<= 1;
+	}
+
+	/* Two, four and eight zero bits */
+	GF2MatrixSquare(Even,Odd);
+	GF2MatrixSquare(Odd,Even);
+	GF2MatrixSquare(CrcShiftMatrix[0],Odd);
+
+	for (n = 1; n < 32; n++)
+		GF2MatrixSquare(CrcShiftMatrix[n],CrcShiftMatrix[n-1]);
+	CrcShiftReady = 1;
+	return;
+}
+
+/* Advance crc32 over Len zero bytes in O(log Len) */
+static
+UINT32
+ShiftCRC32(UINT32 crc32, UINT32 Len)
+{
+	int n;
+
+#ifdef __KERNEL__
+	if (!CrcShiftReady)
+		InitCRC32Shift();
+#else
+	pthread_once(&CrcShiftOnce,InitCRC32Shift);
+#endif
+
+	for (n = 0; Len != 0; n++, Len >>= 1)
+	{
+		if (Len & 1)
+			crc32 = GF2MatrixTimes(CrcShiftMatrix[n],crc32);
+	}
+	return crc32;
+}
+
+UINT32
+CombineCRC32(UINT32 crc1, UINT32 crc2, UINT32 Len2)
+{
+	return ShiftCRC32(crc1,Len2) ^ crc2;
+}
+
+UINT32
+FillCRC32(unsigned char Data, UINT32 Size)
+{
+	UINT32 crc32,Done;
+	int Bit;
+
+	/* Double the run for each bit of Size, from the top */
+	crc32 = 0;
+	Done = 0;
+	for (Bit = 31; Bit >= 0; Bit--)
+	{
+		if (Done != 0)
+		{
+			crc32 = CombineCRC32(crc32,crc32,Done);
+			Done <<= 1;
+		}
+		if (Size & (1UL << Bit))
+		{
+			crc32 = CombineCRC32(crc32,CalculateCRC32(&Data,1),1);
+			Done++;
+		}
+	}
+	return crc32;
+}
+
 UINT32
 CalculateCRC32(unsigned char *Buffer, UINT32 Size)
 {
-    UINT32 i,crc32 = 0xFFFFFFFF;
+	UINT32 crc32;
 
-	/* Read the data and calculate crc32 */	
-    for(i = 0; i < Size; i++)
-		crc32 = ((crc32) >> 8) ^ CrcLookUpTable[(Buffer[i]) 
-								^ ((crc32) & 0x000000FF)];
-	return ~crc32;
+	BeginCRC32(&crc32);
+	UpdateCRC32(&crc32,Buffer,Size);
+	EndCRC32(&crc32);
+	return crc32;
 }
 
 void
@@ -178,6 +683,15 @@ DoCRC32(UINT32 *crc32, unsigned char Data)
 	return;
 }
 
+void
+UpdateCRC32(UINT32 *crc32, unsigned char *Buffer, UINT32 Size)
+{
+	ReadyCRC32Tables();
+
+	*crc32 = KernelCRC32(FoldCRC32,*crc32,Buffer,Size);
+	return;
+}
+
 void
 EndCRC32(UINT32 *crc32)
 {
@@ -185,3 +699,4 @@ EndCRC32(UINT32 *crc32)
 	return;
 }
 
+
@@ -74,13 +74,15 @@ CreateFirmwareInfo(unsigned char *Data, char * BuildFile,
 #endif
 
 	/* Oem Extensions */
-	char Key[80];			
+	inisection Global;
 	char *OemKeys, *OemKeyName,*OemKeyValue,*Next;
 	char OemKeyStr[128];
 
 
+	Global = iniparser_section(d,"GLOBAL");
+
 	/* Get BUILD NO if specificed in config, else try to get from BUILDNO */
-	BuildNo = iniparser_getlong(d,"GLOBAL:BuildNo",0);
+	BuildNo = section_getlong(Global,"buildno",0);
 	if (BuildNo == 0)
 	{
 		/* Open Module File */
@@ -111,15 +113,15 @@ CreateFirmwareInfo(unsigned char *Data, char * BuildFile,
 	else
 		len +=sprintf((char *)Data+len,"FW_DESC=WARNING : UNOFFICIAL BUILD!! \n");
 
-	ProductId = iniparser_getlong(d,"GLOBAL:ProductId",0);
+	ProductId = section_getlong(Global,"productid",0);
 	if (ProductId != 0)
 		len +=sprintf((char *)Data+len,"FW_PRODUCTID=%ld\n",ProductId);
-	ProductName = iniparser_getstr(d,"GLOBAL:ProductName");
+	ProductName = section_getstr(Global,"productname");
 	if (ProductName != NULL)
 		len +=sprintf((char *)Data+len,"FW_PRODUCTNAME=%s\n",ProductName);
 
 	/* Oem Extensions if any */
-	OemKeys = iniparser_getstr(d,"GLOBAL:Oemkeys");
+	OemKeys = section_getstr(Global,"oemkeys");
 	if (OemKeys != NULL)
 	{
 		strncpy(OemKeyStr,OemKeys,127);
@@ -130,8 +132,7 @@ CreateFirmwareInfo(unsigned char *Data, char * BuildFile,
 		OemKeyName = GetOemKey(&Next);
 		while (OemKeyName != NULL)
 		{
-			sprintf(Key,"GLOBAL:%s",OemKeyName);
-			OemKeyValue = iniparser_getstr(d,Key);
+			OemKeyValue = section_getstr(Global,OemKeyName);
 				if (OemKeyValue!= NULL)
 			len +=sprintf((char *)Data+len,"OEM_%s=%s\n",OemKeyName,OemKeyValue);
 			OemKeyName = GetOemKey(&Next);
@@ -1,13 +1,19 @@
+#define _GNU_SOURCE		/* copy_file_range */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <malloc.h>
 #include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <linux/fs.h>
 
 #include "iniparser.h"
 #include "fmh.h"
@@ -19,18 +25,182 @@ typedef struct sc
 	UINT32 Size;
 	unsigned char Major;
 	unsigned char Minor;
-	struct sc *Next;
-} SECTION_CHAIN;
+
+	/* Content of the section, filled once it is written to the image.
+	 * Everything else in Loc..Loc+Size is left erased (0xFF) */
+	int Written;
+	int Kept;				/* Left as it was in the previous image */
+	int HasFMH;
+	int HasAltFMH;
+	UINT32 FMHOffset;		/* FMH offset from Loc */
+	FMH Fmh;
+	ALT_FMH AltFmh;			/* At the end of the first block */
+	UINT32 ModOffset;		/* Module offset from Loc */
+	UINT32 ModSize;
+	UINT32 ModCRC;			/* CRC32 of the module data */
+
+	struct sc *Next;		/* Next section in flash order */
+
+	/* Interval tree of the used flash: AVL tree ordered by Loc */
+	struct sc *Left;
+	struct sc *Right;
+	int Height;
+	UINT32 MaxEnd;			/* Highest Loc+Size in the subtree */
+	UINT32 MinLoc;			/* Lowest Loc in the subtree */
+	UINT32 MaxGap;			/* Largest free area between its sections */
+} SECTION;
+
+/* Sections are allocated in blocks and freed together with the map */
+#define SECTION_POOL_SIZE	64
+typedef struct sp
+{
+	struct sp *Next;
+	int Used;
+	SECTION Sec[SECTION_POOL_SIZE];
+} SECTION_POOL;
+
+/* Used areas of the flash */
+typedef struct
+{
+	SECTION *Root;
+	SECTION *First;			/* Lowest section, start of the Next list */
+	SECTION_POOL *Pool;
+	int Count;
+} SECTION_MAP;
+
+/* Section found in the previous image (--update) */
+typedef struct
+{
+	UINT32 Loc;				/* Section start */
+	UINT32 FMHOffset;		/* FMH offset from Loc */
+	FMH Fmh;
+	int HasAltFMH;
+	ALT_FMH AltFmh;
+	int Kept;				/* Still in the new image, unchanged */
+} OLD_SECTION;
+
+/* Module checksum cache entry. A module whose file still has the same
+ * identity (path, device, inode, size and modification time) is not
+ * read again to get its checksum */
+typedef struct
+{
+	char *Path;
+	unsigned long long Dev;
+	unsigned long long Ino;
+	unsigned long long Size;
+	long long MtimeNs;
+	UINT32 CRC;
+	int Valid;				/* CRC matches the identity */
+	int Used;				/* Module of this build, kept in the cache */
+} CRC_CACHE_ENTRY;
+
+/* A module whose copy is handed to the worker pool (-j). Its FMH is
+ * created once the copy is done and the module checksum is known */
+typedef struct
+{
+	char *SecName;
+	char *InFile;
+	UINT32 Location;		/* Section start in Flash */
+	UINT32 AllocSize;
+	UINT32 FMHLoc;
+	MODULE_INFO Mod;
+	CRC_CACHE_ENTRY *Cached;	/* Cache entry, valid for the whole build */
+	SECTION *Section;
+	int Status;
+} MODULE_JOB;
+
+/* Compiled layout plan (see CompileLayoutPlan). It is followed by the
+ * sections, the GLOBAL key/value string pairs and the string table */
+typedef struct
+{
+	char Magic[16];
+	UINT32 IniSize;			/* Size and CRC32 of the config file */
+	UINT32 IniCRC;
+	UINT32 PlanSize;		/* Whole plan, strings included */
+	UINT32 FlashSize;
+	UINT32 BlockSize;
+	UINT32 UseFMH;
+	UINT32 Placement;		/* PLACE_xxx, for Locate = AUTO */
+	UINT32 Output;			/* Strings, as string table offsets */
+	UINT32 OutDir;
+	UINT32 nSections;
+	UINT32 nGlobals;
+	UINT32 StrSize;
+} LAYOUT_HEADER;
+
+/* Section of the plan, with the defaults of the config already applied */
+typedef struct
+{
+	UINT32 Name;
+	UINT32 File;			/* PLAN_NOSTR if missing (and for firmware) */
+	UINT32 Type;
+	UINT32 Major;
+	UINT32 Minor;
+	UINT32 Flags;
+	UINT32 Offset;			/* Module offset in the section */
+	UINT32 Load;
+	UINT32 Alloc;
+	UINT32 FMHLoc;
+	UINT32 LocateKind;		/* LOCATE_xxx */
+	UINT32 Locate;			/* Address for LOCATE_ADDR */
+} LAYOUT_SECTION;
+
+typedef struct
+{
+	LAYOUT_HEADER *Hdr;
+	LAYOUT_SECTION *Sec;
+	UINT32 *Globals;		/* Key and value of each GLOBAL entry */
+	char *Str;
+	UINT32 Size;
+	int Mapped;
+} LAYOUT_PLAN;
 
 unsigned char FirmwareInfo[64*1024];
 
+/* Scratch buffer for bulk file reads and copies */
+#define IO_CHUNK_SIZE	(1024*1024)
+static unsigned char IOBuffer[IO_CHUNK_SIZE] __attribute__ ((aligned (4096)));
+
+/* Whole output image, when it is built through a shared mapping (-M) */
+static unsigned char *gImageMap = NULL;
+static UINT32 gImageSize;
+
 int  ParseIniFile(char * ini_name);
-UINT32  FillModuleInfo(MODULE_INFO *Mod,char *InFile);
+UINT32  FillModuleInfo(MODULE_INFO *Mod,char *InFile,CRC_CACHE_ENTRY **Cached);
 int WriteFMHtoFile(FILE *fd,FMH *fmh,ALT_FMH *altfmh,UINT32 Start,
 													UINT32 BlockSize);
-int WriteModuletoFile(FILE *Outfd,char *InFile, UINT32 Location);
+int WriteModuletoFile(FILE *Outfd,char *InFile, UINT32 Location,MODULE_INFO *mod,
+												CRC_CACHE_ENTRY *Cached);
+int LoadCRCCache(char *CacheFile);
+int SaveCRCCache(char *CacheFile);
 int WriteFirmwareInfo(FILE *Outfd,char *Data,UINT32 Size, UINT32 Location);
-int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart);
+int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart,
+													SECTION_MAP *Map);
+int EraseUnusedFlash(FILE *fd,SECTION_MAP *Map,UINT32 FlashSize);
+int ScanOldImage(FILE *fd,UINT32 FlashSize,UINT32 BlockSize,OLD_SECTION **pSections);
+int LoadReferenceImage(char *RefFile,UINT32 FlashSize,UINT32 BlockSize);
+unsigned long ChangedBlocks(FILE *fd,UINT32 FlashSize,UINT32 BlockSize);
+int CachedModuleCRC(char *InFile,UINT32 Size,CRC_CACHE_ENTRY *Cached,UINT32 *crc32);
+int PlanImageChecksum(SECTION_MAP *Map,unsigned long ImageHeaderStart,UINT32 *pCRC);
+void ShowLayoutManifest(SECTION_MAP *Map,UINT32 FlashSize,UINT32 BlockSize,
+					int UseFMH,int HaveImageCRC,UINT32 ImageCRC,int Ok);
+void PlaceFromReference(SECTION_MAP *Map,MODULE_JOB *Layout,int nLayout,
+												UINT32 FlashSize);
+int KeepOldSection(SECTION *Section,MODULE_INFO *mod,char *InFile,
+			UINT32 Location,UINT32 AllocSize,UINT32 FMHLoc,CRC_CACHE_ENTRY *Cached);
+int FinishSection(FILE *Outfd,SECTION *Section,char *SecName,MODULE_INFO *mod,
+			UINT32 Location,UINT32 AllocSize,UINT32 FMHLoc,int UseFMH,UINT32 BlockSize);
+int RunModuleJobs(FILE *Outfd,MODULE_JOB *Jobs,int nJobs,int nThreads);
+int AddSection(SECTION_MAP *Map,UINT32 Loc,UINT32 Size,char *Name,
+				unsigned char Major,unsigned char Minor,SECTION **pEntry);
+SECTION *NextFreeGap(SECTION_MAP *Map,SECTION *Prev,UINT32 FlashSize,
+								UINT32 *pStart,UINT32 *pEnd);
+void FreeSectionMap(SECTION_MAP *Map);
+int LoadLayout(char *ini_name,LAYOUT_PLAN *Plan,dictionary **pd);
+int CompileLayoutPlan(dictionary *d,LAYOUT_PLAN *Plan);
+int MapLayoutPlan(char *PlanName,UINT32 IniSize,UINT32 IniCRC,LAYOUT_PLAN *Plan);
+int SaveLayoutPlan(char *PlanName,LAYOUT_PLAN *Plan);
+void FreeLayoutPlan(LAYOUT_PLAN *Plan);
 
 extern UINT32 CreateFirmwareInfo(unsigned char *Data, char *BuildFile,
 			unsigned char Major, unsigned char Minor,dictionary *d);
@@ -39,6 +209,56 @@ extern unsigned char  CalculateModule100(unsigned char *Buffer, unsigned long Si
 static char CmdInDir[256]; 
 static char CmdOutDir[256];
 static char CmdCfgFile[256];
+static int CmdMapOutput = 0;
+static int CmdJobs = 1;
+static int CmdNoCache = 0;
+static int CmdUpdate = 0;
+
+/* Dry run (--plan): resolve the image and show it, write nothing.
+ * The JSON manifest keeps stdout, everything else goes to stderr */
+#define DRYRUN_TEXT			1
+#define DRYRUN_JSON			2
+static int CmdDryRun = 0;
+static FILE *gManifestOut = NULL;
+
+/* Sections of the image being updated. Only their contents can differ
+ * from erased flash in the existing output file */
+static OLD_SECTION *gOldSections = NULL;
+static int gnOldSections = 0;
+static int gUpdating = 0;
+
+/* Previous release the layout is planned against (-r). Its sections, and
+ * the crc32 of each of its erase blocks to count the blocks that change */
+static char CmdRefFile[256];
+static OLD_SECTION *gRefSections = NULL;
+static int gnRefSections = 0;
+static UINT32 *gRefBlockCRC = NULL;
+static UINT32 gnRefBlocks = 0;
+
+/* Module checksum cache, kept next to the output file. Entries are
+ * allocated one by one so the pointers held by the jobs stay valid
+ * when the table grows */
+#define CRC_CACHE_SUFFIX	".crccache"
+#define CRC_CACHE_MAGIC		"GENIMAGE-CRC-CACHE 1"
+static CRC_CACHE_ENTRY **gCRCCache = NULL;
+static int gCRCCacheCount = 0;
+static int gCRCCacheAlloc = 0;
+static char CRCCacheFile[256+sizeof(CRC_CACHE_SUFFIX)];
+
+/* Compiled layout plan, kept next to the config file */
+#define PLAN_SUFFIX			".plan"
+#define PLAN_MAGIC			"GENIMAGE-PLAN 2"
+#define PLAN_NOSTR			0xFFFFFFFF
+#define LOCATE_ADDR			0		/* START or a flash address */
+#define LOCATE_END			1		/* At the end of flash */
+#define LOCATE_NONE			2		/* Missing or invalid */
+#define LOCATE_AUTO			3		/* Placed in the free flash */
+
+/* Placement policies of the Locate = AUTO sections (GLOBAL:Placement) */
+#define PLACE_FIRSTFIT		0		/* Lowest free area it fits in */
+#define PLACE_BESTFIT		1		/* Smallest free area it fits in */
+#define PLACE_ALIGNED		2		/* First fit on a multiple of its size */
+static char PlanFile[256+sizeof(PLAN_SUFFIX)];
 
 static unsigned long gBlkSize;
 
@@ -86,6 +306,13 @@ Usage(char *Prog)
 	printf("\t -I Input Files Path\n"); 
 	printf("\t -O Output Files Path\n"); 
 	printf("\t -C Config File Name\n");
+	printf("\t -j Number of modules to copy in parallel\n");
+	printf("\t -u, --update Rewrite only the changed sections of an existing image\n");
+	printf("\t -r, --reference Keep the AUTO sections where a previous image has them\n");
+	printf("\t -p, --plan[=json] Show the layout and checksums without writing the image\n");
+	printf("\t -n Do not use the module checksum cache\n");
+	printf("\t -M Build the image in a memory mapped output file\n");
+	printf("\t -t Run CRC32 self test and exit\n");
 	printf("\n");
 }
 
@@ -95,14 +322,21 @@ main(int argc, char * argv[])
 	int	status;
 	int opt;
 	char *ProgName;
+	static struct option LongOpts[] =
+	{
+		{ "update", no_argument, NULL, 'u' },
+		{ "reference", required_argument, NULL, 'r' },
+		{ "plan", optional_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	/* Skip Program Name */
 	ProgName = argv[0];
 
 	/* Initialize with empty values */
-	CmdInDir[0] = CmdOutDir[0] = CmdCfgFile[0] = 0;
+	CmdInDir[0] = CmdOutDir[0] = CmdCfgFile[0] = CmdRefFile[0] = 0;
 
-	while ((opt = getopt(argc, argv, "i:o:c:h")) != -1)
+	while ((opt = getopt_long(argc, argv, "i:o:c:j:r:p::nuMth", LongOpts, NULL)) != -1)
 	{
 		 switch (opt)
 		 {
@@ -115,350 +349,1351 @@ main(int argc, char * argv[])
 			case 'c':
 				strcpy(CmdCfgFile, optarg);
 				break;
+			case 'j':
+				CmdJobs = atoi(optarg);
+				if (CmdJobs < 1)
+					CmdJobs = 1;
+				break;
+			case 'n':
+				CmdNoCache = 1;
+				break;
+			case 'u':
+				CmdUpdate = 1;
+				break;
+			case 'r':
+				strcpy(CmdRefFile, optarg);
+				break;
+			case 'p':
+				CmdDryRun = DRYRUN_TEXT;
+				if ((optarg != NULL) && (strcmp(optarg,"json") == 0))
+					CmdDryRun = DRYRUN_JSON;
+				else if (optarg != NULL)
+				{
+					Usage(ProgName);
+					exit(1);
+				}
+				break;
+			case 'M':
+				CmdMapOutput = 1;
+				break;
+			case 't':
+				if (SelfTestCRC32() != 0)
+				{
+					printf("ERROR: CRC32 self test failed\n");
+					exit(1);
+				}
+				printf("CRC32 self test passed\n");
+				exit(0);
 			default:
 				Usage(ProgName);
 				exit(1);
 		}
 	}
 
+	/* Keep stdout for the JSON manifest only */
+	if (CmdDryRun == DRYRUN_JSON)
+	{
+		fflush(stdout);
+		gManifestOut = fdopen(dup(fileno(stdout)),"w");
+		if ((gManifestOut == NULL) || (dup2(fileno(stderr),fileno(stdout)) < 0))
+		{
+			printf("ERROR: Unable to set up the JSON output\n");
+			exit(1);
+		}
+	}
+
 	if (CmdCfgFile[0] != 0)
 		status = ParseIniFile(CmdCfgFile);
 	else
 		status = ParseIniFile("genimage.ini");
+
+	if (gManifestOut != NULL)
+		fclose(gManifestOut);
 	
 	return status ;
 }
 
 void
-DisplayFlashMap(SECTION_CHAIN *Chain, UINT32 FlashSize)
+DisplayFlashMap(SECTION_MAP *Map, UINT32 FlashSize)
 {
-	UINT32 Loc = 0;
+	SECTION *Section = NULL;
+	UINT32 Start,End;
 	
 	printf("\n");	
 	printf("-----------------------------------------------\n");
 	printf("             Flash Memory Map                  \n");
 	printf("-----------------------------------------------\n");
-	while (Chain)
+	do
 	{
-		if (Chain->Loc > Loc)		
-			printf("0x%07lX - 0x%07lX : *******FREE*******\n",Loc, Chain->Loc);
-		printf("0x%07lX - 0x%07lX : %8s : Ver %d.%d\n",Chain->Loc,Chain->Loc+Chain->Size,Chain->Name, Chain->Major,Chain->Minor);
-		
-		Loc = Chain->Loc+Chain->Size;			
-		Chain = Chain->Next;
-	}
-
-	if (Loc < FlashSize)
-		printf("0x%07lX - 0x%07lX : *******FREE*******\n",Loc, FlashSize);
+		Section = NextFreeGap(Map,Section,FlashSize,&Start,&End);
+		if (End > Start)		
+			printf("0x%07lX - 0x%07lX : *******FREE*******\n",Start,End);
+		if (Section != NULL)
+			printf("0x%07lX - 0x%07lX : %8s : Ver %d.%d\n",Section->Loc,Section->Loc+Section->Size,Section->Name, Section->Major,Section->Minor);
+	} while (Section != NULL);
 	printf("-----------------------------------------------\n");
 	return;
 }
 
-int
-AddToUsedChain(SECTION_CHAIN **pChain,UINT32 Loc, UINT32 Size, char *Name,
-				unsigned char Major,unsigned char Minor)
+/* Quote a string for the JSON manifest */
+static
+void
+PutJsonString(FILE *Out,char *Str)
 {
-	SECTION_CHAIN *newchain, *Prev;
-	SECTION_CHAIN *Chain = *pChain;
-
-	/* Allocate memory for new entry */
-	newchain = (SECTION_CHAIN *)malloc(sizeof(SECTION_CHAIN));
-	if (newchain == NULL)
+	fputc('"',Out);
+	for (;*Str != 0;Str++)
 	{
-		printf("INTERNAL ERROR: Unable to allocate memory for Chain\n");
-		return 1;			
+		if ((*Str == '"') || (*Str == '\\'))
+			fprintf(Out,"\\%c",*Str);
+		else if ((unsigned char)*Str < 0x20)
+			fprintf(Out,"\\u%04x",(unsigned char)*Str);
+		else
+			fputc(*Str,Out);
 	}
+	fputc('"',Out);
+}
 
-	/* Fill the Entries */
-	newchain->Loc  = Loc;
-	newchain->Size = Size;
-	newchain->Major = Major;
-	newchain->Minor = Minor;
-	strncpy(&(newchain->Name[0]),Name,8);
-	newchain->Name[8] = 0;
-	newchain->Next = NULL;
-		
-	
-	/* If first entry */
-	if (Chain == NULL)	
+/* Print what a dry run (--plan) resolved: the FMH and module of each 
+ * section in flash order, the free areas and the image checksum. As a
+ * table, or as JSON for --plan=json */
+void
+ShowLayoutManifest(SECTION_MAP *Map,UINT32 FlashSize,UINT32 BlockSize,
+					int UseFMH,int HaveImageCRC,UINT32 ImageCRC,int Ok)
+{
+	SECTION *Section = NULL;
+	MODULE_INFO *mod;
+	UINT32 Start,End;
+	FILE *Out = (gManifestOut != NULL) ? gManifestOut : stdout;
+	int Json = (CmdDryRun == DRYRUN_JSON);
+	int n = 0;
+
+	if (Json)
 	{
-		*pChain = newchain;
-		return 0;
-	}		
-
-	/* Traverse chain to find the right spot */
-	Prev = NULL;
-	while (Chain)
+		fprintf(Out,"{\n  \"status\": \"%s\",\n",Ok ? "ok" : "failed");
+		fprintf(Out,"  \"flash_size\": %lu,\n  \"block_size\": %lu,\n",FlashSize,BlockSize);
+		fprintf(Out,"  \"fmh\": %s,\n  \"sections\": [",UseFMH ? "true" : "false");
+	}
+	else
 	{
-		/* Check if overlaps exactly on other section */
-		if (Loc == Chain->Loc)
-		{
-			printf("ERROR: Section %s overlaps with Section %s\n",Name,Chain->Name);
-			return 2;			
-		}
-
-		/* If our start is below the current entry */
-		if (Loc < Chain->Loc)
-		{
-			/* Check if our section's end overlaps with current section */
-			if ((Loc+Size) > Chain->Loc) 				
-			{
-				printf("ERROR: Section %s overlaps with Section %s\n",Name,Chain->Name);
-				return 2;	
-			}
-			
-			/* We got our spot !!*/
-			break;			
-		}
-
-		/* If our start is above the current entry*/
-		if (Loc > Chain->Loc)
+		fprintf(Out,"\n");
+		fprintf(Out,"---------------------------------------------------------------------------------\n");
+		fprintf(Out,"                                  Layout Plan                                    \n");
+		fprintf(Out,"---------------------------------------------------------------------------------\n");
+		fprintf(Out,"Section   Location  Alloc     FMH       Module    Size      Type    CRC32\n");
+	}
+	for (Section = Map->First; Section != NULL; Section = Section->Next)
+	{
+		if (!Section->Written)
+			continue;
+		mod = &Section->Fmh.Module_Info;
+		if (!Json)
 		{
-			/* Check if our section's begin overlaps with the current section */
-			if (Loc < (Chain->Loc + Chain->Size))
-			{
-				printf("ERROR: Section %s overlaps with Section %s\n",Name,Chain->Name);
-				return 2;				
-			}
+			fprintf(Out,"%-8s  0x%07lX 0x%07lX ",Section->Name,Section->Loc,Section->Size);
+			if (Section->HasFMH)
+				fprintf(Out,"0x%07lX ",Section->Loc+Section->FMHOffset);
+			else
+				fprintf(Out,"%-9s ","-");
+			fprintf(Out,"0x%07lX 0x%07lX 0x%04X  0x%08lX\n",Section->Loc+Section->ModOffset,
+					Section->ModSize,mod->Module_Type,Section->ModCRC);
+			continue;
 		}
-
-		/* We are well above the current entry. So Continue with the chain traverse */		
-		Prev = Chain;
-		Chain = Chain->Next;	
+		fprintf(Out,"%s\n    { \"name\": ",(n++ == 0) ? "" : ",");
+		PutJsonString(Out,Section->Name);
+		fprintf(Out,", \"location\": %lu, \"alloc\": %lu, ",Section->Loc,Section->Size);
+		if (Section->HasFMH)
+			fprintf(Out,"\"fmh_offset\": %lu, \"fmh_checksum\": %u, ",
+					Section->Loc+Section->FMHOffset,Section->Fmh.FMH_Header_Checksum);
+		else
+			fprintf(Out,"\"fmh_offset\": null, \"fmh_checksum\": null, ");
+		if (Section->HasAltFMH)
+			fprintf(Out,"\"alt_fmh_offset\": %lu, ",Section->Loc+BlockSize-sizeof(ALT_FMH));
+		fprintf(Out,"\"version\": \"%d.%d\", \"type\": %u, \"flags\": %u, \"load\": %lu, ",
+					Section->Major,Section->Minor,mod->Module_Type,mod->Module_Flags,
+					mod->Module_Load_Address);
+		fprintf(Out,"\"module_offset\": %lu, \"module_size\": %lu, \"crc32\": %lu }",
+					Section->Loc+Section->ModOffset,Section->ModSize,Section->ModCRC);
 	}
-	
-	/* If new entry is to be added to first of chain */
-	if (Prev == NULL)	
+
+	if (!Json)
 	{
-		newchain->Next = *pChain;
-		*pChain = newchain;
-		return 0;
+		fprintf(Out,"---------------------------------------------------------------------------------\n");
+		if (HaveImageCRC)
+			fprintf(Out,"Image checksum 0x%08lX\n",ImageCRC);
+		else
+			fprintf(Out,"Image checksum unknown\n");
+		fflush(Out);
+		return;
 	}
 
-	/* Add to Middle or last of chain */
-	newchain->Next = Prev->Next;
-	Prev->Next = newchain;
-	return 0;
+	fprintf(Out,"\n  ],\n  \"free\": [");
+	n = 0;
+	Section = NULL;
+	do
+	{
+		Section = NextFreeGap(Map,Section,FlashSize,&Start,&End);
+		if (End > Start)
+			fprintf(Out,"%s\n    { \"start\": %lu, \"end\": %lu }",
+						(n++ == 0) ? "" : ",",Start,End);
+	} while (Section != NULL);
+	fprintf(Out,"\n  ],\n  \"image_checksum\": ");
+	if (HaveImageCRC)
+		fprintf(Out,"%lu\n}\n",ImageCRC);
+	else
+		fprintf(Out,"null\n}\n");
+	fflush(Out);
 }
 
-
-int 
-ParseIniFile(char* ini_name)
+/* Walk the free flash in order, starting with Prev NULL. Gives the gap 
+ * [*pStart,*pEnd) after Prev and returns the section that ends it, or 
+ * NULL for the gap up to the end of flash */
+SECTION *
+NextFreeGap(SECTION_MAP *Map,SECTION *Prev,UINT32 FlashSize,
+								UINT32 *pStart,UINT32 *pEnd)
 {
-	/* INI Parser Related */
-	dictionary *d;			/* Dictionary */
-	int nsecs,i;			/* Number of Sections */
-	char Key[80];			/* To Form the Key to be passed to ini functions */
-	char *SecName;			/* Section Name */
-	
-	/* Global Information */	
-	char *OutFile;			/* Output Bin File */
-	INT32 FlashSize;			/* Size of Flash */
-	INT32 BlockSize;			/* Size of each Flash Block */
-	char *InDir;			/* Location of Input Files */
-	char *OutDir;			/* Location of Output File */
-
-	/* Output File Creation Related */	
-	FILE *Outfd;			/* Output File Descriptor */
-	UINT32 Erase;	/* Dummy char used to create the output file */
-	SECTION_CHAIN *UsedChain;/* Used for checking overlapping sections */
-
-	/* FMH Related */
-	FMH fmh;				/* Flash Module Header */	
-	ALT_FMH altfmh,*paltfmh;	/* Alternate Flash Module Header */
-	MODULE_INFO mod;		/* Module Information */
-	char *InFile;			/* Input File for FMH Section */
-	UINT32 InFileSize; /* Size of Section File */
-	UINT32 AllocSize;/* Total Allocation Size for this FMH */
-	UINT32 MinAllocSize;/* Mininmum Calculated Allocation Size */
-	UINT32 FMHLoc;	/* Alternate FMH Location */
-	char *LocationStr;		/* Flash Location String */ 
-	UINT32 Location;	/* Flash Location Value */
+	SECTION *Next;
+
+	*pStart = (Prev != NULL) ? Prev->Loc+Prev->Size : 0;
+	Next = (Prev != NULL) ? Prev->Next : Map->First;
+	*pEnd = (Next != NULL) ? Next->Loc : FlashSize;
+	if (*pEnd < *pStart)
+		*pEnd = *pStart;
+	return Next;
+}
 
-	/* RACTRENDS releted */
-	char *BuildFile;		/* Build Number File */
-	char *VersionStr;		/* Major and Minor String */
-	int FirmwareMajor,FirmwareMinor;
-	unsigned char ModuleFormat;
-	unsigned long ImageHeaderStart = 0xFFFFFFFF; /* This points to the MODULE FIRMWARE start address */
-	int UseFMH=1;
+static
+int
+SectionHeight(SECTION *Node)
+{
+	return (Node != NULL) ? Node->Height : 0;
+}
 
-	/*Load the ini File into dictionary*/	
-	d = iniparser_load(ini_name);
-	if (d==NULL) 
+/* Recompute the height and highest end of a node from its children */
+static
+void
+UpdateSectionNode(SECTION *Node)
+{
+	int Left = SectionHeight(Node->Left);
+	int Right = SectionHeight(Node->Right);
+
+	Node->Height = ((Left > Right) ? Left : Right) + 1;
+	Node->MaxEnd = Node->Loc+Node->Size;
+	Node->MinLoc = Node->Loc;
+	Node->MaxGap = 0;
+	if (Node->Left != NULL)
 	{
-		printf("Error:Cannot parse file [%s]\n", ini_name);
-		return 1 ;
+		if (Node->Left->MaxEnd > Node->MaxEnd)
+			Node->MaxEnd = Node->Left->MaxEnd;
+		Node->MinLoc = Node->Left->MinLoc;
+		Node->MaxGap = Node->Left->MaxGap;
+		if (Node->Loc - Node->Left->MaxEnd > Node->MaxGap)
+			Node->MaxGap = Node->Loc - Node->Left->MaxEnd;
 	}
-#if DEBUG	
-	iniparser_dump(d, stderr);
-#endif	
-	
-
-	/* Get the global information */
-	OutFile = iniparser_getstr(d,"GLOBAL:Output");
-	if (OutFile == NULL)
+	if (Node->Right != NULL)
 	{
-		printf("Error: Unable to get Output file name\n");
-		iniparser_freedict(d);
-		return 1;
+		if (Node->Right->MaxEnd > Node->MaxEnd)
+			Node->MaxEnd = Node->Right->MaxEnd;
+		if (Node->Right->MaxGap > Node->MaxGap)
+			Node->MaxGap = Node->Right->MaxGap;
+		if (Node->Right->MinLoc - (Node->Loc+Node->Size) > Node->MaxGap)
+			Node->MaxGap = Node->Right->MinLoc - (Node->Loc+Node->Size);
 	}
-	FlashSize = iniparser_getlong(d,"GLOBAL:FlashSize",0);
-	if (FlashSize == 0)
+}
+
+static
+SECTION *
+RotateSection(SECTION *Node,int ToLeft)
+{
+	SECTION *Top;
+
+	if (ToLeft)
 	{
-		printf("Error: Unable to get Flash Size\n");
-		iniparser_freedict(d);
-		return 1;
-	}	
-	BlockSize = iniparser_getlong(d,"GLOBAL:BlockSize",0);
-	gBlkSize = BlockSize;
-	if (BlockSize == 0)
+		Top = Node->Right;
+		Node->Right = Top->Left;
+		Top->Left = Node;
+	}
+	else
 	{
-		printf("Error: Unable to get Block Size\n");
-		iniparser_freedict(d);
-		return 1;
-	}	
+		Top = Node->Left;
+		Node->Left = Top->Right;
+		Top->Right = Node;
+	}
+	UpdateSectionNode(Node);
+	UpdateSectionNode(Top);
+	return Top;
+}
 
-	UseFMH = iniparser_getlong(d,"GLOBAL:FMHEnable",1);
-	printf("The Image file %s have FMH\n",UseFMH?"will":"will not");
+/* Insert a node in an AVL subtree. Returns the new subtree root */
+static
+SECTION *
+InsertSectionNode(SECTION *Root,SECTION *New)
+{
+	int Balance;
 
-	/* Get the Input and Output Directory Path */
-	if (CmdOutDir[0] == 0)
-		OutDir = iniparser_getstr(d,"GLOBAL:OutDir");
-	else
-		OutDir = &CmdOutDir[0];
-	
-	if (CmdInDir[0] == 0)
-		InDir  = iniparser_getstr(d,"GLOBAL:OutDir");
+	if (Root == NULL)
+	{
+		UpdateSectionNode(New);
+		return New;
+	}
+	if (New->Loc < Root->Loc)
+		Root->Left = InsertSectionNode(Root->Left,New);
 	else
-		InDir = &CmdInDir[0];
+		Root->Right = InsertSectionNode(Root->Right,New);
+	UpdateSectionNode(Root);
 
-	/* Convert OutputFile to Full Path */
-	OutFile = Convert2FullPath(OutDir,OutFile);
+	Balance = SectionHeight(Root->Left) - SectionHeight(Root->Right);
+	if (Balance > 1)
+	{
+		if (New->Loc >= Root->Left->Loc)
+			Root->Left = RotateSection(Root->Left,1);
+		return RotateSection(Root,0);
+	}
+	if (Balance < -1)
+	{
+		if (New->Loc < Root->Right->Loc)
+			Root->Right = RotateSection(Root->Right,0);
+		return RotateSection(Root,1);
+	}
+	return Root;
+}
 
-	printf("\nCreating \"%s\" ...\n",OutFile);
-	printf("FlashSize = 0x%lx BlockSize = 0x%lx\n",FlashSize,BlockSize);
-	
-	/* Create and open the output file */
-	Outfd = fopen(OutFile,"w+b");
-	if (Outfd == NULL)
+/* Lowest section overlapping [Loc,End) */
+static
+SECTION *
+FindOverlap(SECTION *Node,UINT32 Loc,UINT32 End)
+{
+	SECTION *Found;
+
+	while ((Node != NULL) && (Node->MaxEnd > Loc))
 	{
-		printf("Error: Unable to get Create Output file %s\n",OutFile);
-		iniparser_freedict(d);
-		return 1;
+		Found = FindOverlap(Node->Left,Loc,End);
+		if (Found != NULL)
+			return Found;
+		if (Node->Loc >= End)
+			return NULL;
+		if (Node->Loc+Node->Size > Loc)
+			return Node;
+		Node = Node->Right;
 	}
-	Erase = 0xFFFFFFFF;
-	for (i=0;i<FlashSize/4;i++)
-		fwrite(&Erase,4,1,Outfd);
-	
+	return NULL;
+}
 
-	/* Initialize */
-	UsedChain = NULL;
+/* Section with the highest Loc below Loc */
+static
+SECTION *
+FindSectionBelow(SECTION *Node,UINT32 Loc)
+{
+	SECTION *Below = NULL;
 
-	/* Get the number of sections */
-	nsecs = iniparser_getnsec(d);
-	for(i=0;i<nsecs;i++)
+	while (Node != NULL)
 	{
-		memset(&mod,0,sizeof(MODULE_INFO));
-			
-		/* Get the Section Name */
-		SecName = iniparser_getsecname(d,i);		
-		if (SecName == NULL)
+		if (Node->Loc < Loc)
 		{
-			printf("ERROR: Unable to get Name for Section %d\n",i);
-			break;
+			Below = Node;
+			Node = Node->Right;
 		}
-		
-		/* Skip GLOBAL Section. We already processed it */
-		if (strcasecmp(SecName,"GLOBAL") == 0)
-			continue;
-		
-		/* Save Section Name in Module Information. Strip to max 8 characters */
-		if (strlen(SecName) > 8)
-			strncpy((char *)mod.Module_Name,SecName,8);
 		else
-			strcpy((char *)mod.Module_Name,SecName);		
+			Node = Node->Left;
+	}
+	return Below;
+}
 
-		/* Get Module Version */
-		sprintf(Key,"%s:Major",SecName);
-		mod.Module_Ver_Major = iniparser_getint(d,Key,0); 
-		sprintf(Key,"%s:Minor",SecName);
-		mod.Module_Ver_Minor = iniparser_getint(d,Key,0); 
+int
+AddSection(SECTION_MAP *Map,UINT32 Loc, UINT32 Size, char *Name,
+				unsigned char Major,unsigned char Minor,SECTION **pEntry)
+{
+	SECTION *New,*Prev,*Used;
+	SECTION_POOL *Pool;
 
-		/* Get Module Type */
-		sprintf(Key,"%s:Type",SecName);
-		mod.Module_Type = iniparser_getint(d,Key,0x0000);
-		ModuleFormat = (mod.Module_Type >> 8);
-		
-		/* Check if altFMH to be used */		
-		sprintf(Key,"%s:FMHLoc",SecName);
-		FMHLoc = iniparser_getlong(d,Key,0);
-		/* Get Module Location . Default is 0x40 for normal section 
-		 * and one block size for JFFS/JFFS2 */
-		sprintf(Key,"%s:Offset",SecName);
-		/* If Alternate FMH to be used, offset will be 0 if not specified */
-		if (FMHLoc != 0)
-			mod.Module_Location = iniparser_getlong(d,Key,0);		
-		else
+	/* Check for overlaps with any section already placed */
+	Used = FindOverlap(Map->Root,Loc,Loc+Size);
+	if (Used != NULL)
+	{
+		printf("ERROR: Section %s overlaps with Section %s\n",Name,Used->Name);
+		return 2;
+	}
+
+	/* Take the entry from the pool */
+	Pool = Map->Pool;
+	if ((Pool == NULL) || (Pool->Used == SECTION_POOL_SIZE))
+	{
+		Pool = (SECTION_POOL *)malloc(sizeof(SECTION_POOL));
+		if (Pool == NULL)
 		{
-		if ((mod.Module_Type == MODULE_JFFS) || (mod.Module_Type == MODULE_JFFS2)||
-		    (mod.Module_Type == MODULE_JFFS_CONFIG) ||
-		    (mod.Module_Type == MODULE_JFFS2_CONFIG) ||
-		    (ModuleFormat == MODULE_FORMAT_JFFS) ||
-		    (ModuleFormat == MODULE_FORMAT_JFFS2))
-			mod.Module_Location = iniparser_getlong(d,Key,BlockSize);		
-		else
-			mod.Module_Location = iniparser_getlong(d,Key,0x40);		
+			printf("INTERNAL ERROR: Unable to allocate memory for Section\n");
+			return 1;			
 		}
-		if (!UseFMH)
-			mod.Module_Location = 0;
-		
+		Pool->Used = 0;
+		Pool->Next = Map->Pool;
+		Map->Pool = Pool;
+	}
+	New = &Pool->Sec[Pool->Used++];
 
-		/* Get Flags */
-		sprintf(Key,"%s:BootOS",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_OS;
-		sprintf(Key,"%s:BootDIAG",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_DIAG;
-		sprintf(Key,"%s:BootRECO",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_RECOVERY;
-		sprintf(Key,"%s:CopyToRAM",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_COPY_TO_RAM;
-		sprintf(Key,"%s:Execute",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_EXECUTE;
-		sprintf(Key,"%s:Checksum",SecName);
-		if (iniparser_getboolean(d,Key,0) == 1)
-			mod.Module_Flags |= MODULE_FLAG_VALID_CHECKSUM;
-		sprintf(Key,"%s:Compress",SecName);
-		mod.Module_Flags |= iniparser_getint(d,Key,0x00) 
-							<< MODULE_FLAG_COMPRESSION_LSHIFT;
+	/* Fill the Entries */
+	memset(New,0,sizeof(SECTION));
+	New->Loc  = Loc;
+	New->Size = Size;
+	New->Major = Major;
+	New->Minor = Minor;
+	strncpy(&(New->Name[0]),Name,8);
+	New->Name[8] = 0;
+	*pEntry = New;
+
+	/* Link it in flash order and in the tree */
+	Prev = FindSectionBelow(Map->Root,Loc);
+	if (Prev == NULL)
+	{
+		New->Next = Map->First;
+		Map->First = New;
+	}
+	else
+	{
+		New->Next = Prev->Next;
+		Prev->Next = New;
+	}
+	Map->Root = InsertSectionNode(Map->Root,New);
+	Map->Count++;
+	return 0;
+}
 
-		/* Get Load Address */
-		sprintf(Key,"%s:Load",SecName);
-		mod.Module_Load_Address = iniparser_getlong(d,Key,0xFFFFFFFF);
-		if (mod.Module_Load_Address == 0xFFFFFFFF)
-			mod.Module_Flags &= (~MODULE_FLAG_COPY_TO_RAM);
+void
+FreeSectionMap(SECTION_MAP *Map)
+{
+	SECTION_POOL *Pool;
 
-		/* Get Allocation Size */
-		sprintf(Key,"%s:Alloc",SecName);
-		AllocSize = iniparser_getlong(d,Key,0);
+	while (Map->Pool != NULL)
+	{
+		Pool = Map->Pool;
+		Map->Pool = Pool->Next;
+		free(Pool);
+	}
+	memset(Map,0,sizeof(SECTION_MAP));
+}
 
+/* Lowest Loc aligned to Align with Size bytes free in [Start,End) */
+static
+int
+FitInGap(UINT32 Start,UINT32 End,UINT32 Size,UINT32 Align,UINT32 *pLoc)
+{
+	unsigned long long Loc;
 
-		if ((mod.Module_Type == MODULE_FMH_FIRMWARE) || 
-		    (mod.Module_Type == MODULE_FIRMWARE_1_4))
-			AllocSize = BlockSize;
-			
-		/* Module Firmware is a dummy section. It does not have any data */
+	Loc = (((unsigned long long)Start+Align-1)/Align)*Align;
+	if ((Loc >= End) || (End-Loc < Size))
+		return 1;
+	*pLoc = (UINT32)Loc;
+	return 0;
+}
+
+/* First fit between the sections of a subtree. Subtrees without a free
+ * area of Size bytes are skipped */
+static
+int
+FirstFitNode(SECTION *Node,UINT32 Size,UINT32 Align,UINT32 *pLoc)
+{
+	while ((Node != NULL) && (Node->MaxGap >= Size))
+	{
+		if (FirstFitNode(Node->Left,Size,Align,pLoc) == 0)
+			return 0;
+		if ((Node->Left != NULL) && 
+		    (FitInGap(Node->Left->MaxEnd,Node->Loc,Size,Align,pLoc) == 0))
+			return 0;
+		if ((Node->Right != NULL) &&
+		    (FitInGap(Node->Loc+Node->Size,Node->Right->MinLoc,Size,Align,pLoc) == 0))
+			return 0;
+		Node = Node->Right;
+	}
+	return 1;
+}
+
+/* Find free flash for Size bytes aligned to Align */
+int
+FindFreeFlash(SECTION_MAP *Map,UINT32 FlashSize,UINT32 Size,UINT32 Align,
+									int Policy,UINT32 *pLoc)
+{
+	SECTION *Section = NULL;
+	UINT32 Start,End,Loc,Best = 0;
+	int Found = 0;
+
+	if (Map->Root == NULL)
+		return FitInGap(0,FlashSize,Size,Align,pLoc);
+
+	/* Before the first section, between sections and after the last */
+	if (Policy != PLACE_BESTFIT)
+	{
+		if (FitInGap(0,Map->Root->MinLoc,Size,Align,pLoc) == 0)
+			return 0;
+		if (FirstFitNode(Map->Root,Size,Align,pLoc) == 0)
+			return 0;
+		return FitInGap(Map->Root->MaxEnd,FlashSize,Size,Align,pLoc);
+	}
+
+	/* Smallest free area it fits in, the lowest of equal ones */
+	do
+	{
+		Section = NextFreeGap(Map,Section,FlashSize,&Start,&End);
+		if ((FitInGap(Start,End,Size,Align,&Loc) == 0) && 
+		    ((!Found) || (End-Start < Best)))
+		{
+			Best = End-Start;
+			*pLoc = Loc;
+			Found = 1;
+		}
+	} while (Section != NULL);
+	return !Found;
+}
+
+/* Alignment of a section placed by Policy. Every section starts on an
+ * erase block, where its FMH is looked for */
+static
+UINT32
+PlaceAlign(UINT32 Size,UINT32 BlockSize,int Policy)
+{
+	UINT32 Align = BlockSize;
+
+	if (Policy == PLACE_ALIGNED)
+	{
+		while ((Align < Size) && (Align < 0x80000000))
+			Align <<= 1;
+	}
+	return Align;
+}
+
+/* Place the Locate = AUTO sections (those without a Section yet) in the
+ * flash left free by the others, the largest first. Every section that
+ * does not fit is reported. Returns the number of these sections */
+int
+PlaceAutoSections(SECTION_MAP *Map,MODULE_JOB *Layout,int nLayout,
+						UINT32 FlashSize,UINT32 BlockSize,int Policy)
+{
+	SECTION *Section;
+	MODULE_JOB *Job;
+	UINT32 Loc,Align,Start,End,Largest,Free,Needed;
+	int *Order,nAuto,nFailed,k,j,t;
+
+	Order = (int *)malloc((nLayout+1) * sizeof(int));
+	if (Order == NULL)
+	{
+		printf("INTERNAL ERROR: Unable to allocate memory for placement\n");
+		return nLayout;
+	}
+
+	/* Largest first, in config order for equal sizes */
+	nAuto = 0;
+	for (k=0;k<nLayout;k++)
+	{
+		if (Layout[k].Section != NULL)
+			continue;
+		for (j=nAuto;(j > 0) && (Layout[Order[j-1]].AllocSize < Layout[k].AllocSize);j--)
+			Order[j] = Order[j-1];
+		Order[j] = k;
+		nAuto++;
+	}
+
+	nFailed = 0;
+	Needed = 0;
+	for (t=0;t<nAuto;t++)
+	{
+		Job = &Layout[Order[t]];
+		Align = PlaceAlign(Job->AllocSize,BlockSize,Policy);
+		if (FindFreeFlash(Map,FlashSize,Job->AllocSize,Align,Policy,&Loc) != 0)
+		{
+			Order[nFailed++] = Order[t];
+			Needed += Job->AllocSize;
+			continue;
+		}
+		if (AddSection(Map,Loc,Job->AllocSize,Job->SecName,Job->Mod.Module_Ver_Major,
+							Job->Mod.Module_Ver_Minor,&Job->Section) != 0)
+		{
+			Job->Section = NULL;
+			Order[nFailed++] = Order[t];
+			Needed += Job->AllocSize;
+			continue;
+		}
+		Job->Location = Loc;
+		printf("%s: Auto location @ 0x%lx\n",Job->SecName,Loc);
+	}
+
+	if (nFailed == 0)
+	{
+		free(Order);
+		return 0;
+	}
+
+	/* Report what did not fit and the free flash that is left */
+	Largest = Free = 0;
+	Section = NULL;
+	do
+	{
+		Section = NextFreeGap(Map,Section,FlashSize,&Start,&End);
+		Free += End-Start;
+		if (End-Start > Largest)
+			Largest = End-Start;
+	} while (Section != NULL);
+
+	for (t=0;t<nFailed;t++)
+	{
+		Job = &Layout[Order[t]];
+		printf("ERROR: No room in Flash for Section %s : needs 0x%lx bytes aligned to 0x%lx\n",
+				Job->SecName,Job->AllocSize,PlaceAlign(Job->AllocSize,BlockSize,Policy));
+	}
+	printf("ERROR: %d section(s) need 0x%lx bytes. Free Flash is 0x%lx bytes, the largest free area 0x%lx bytes\n",
+					nFailed,Needed,Free,Largest);
+	if (Needed > Free)
+		printf("ERROR: Flash is 0x%lx bytes too small\n",Needed-Free);
+	else
+		printf("ERROR: Free Flash is too fragmented. Free areas are :\n");
+	Section = NULL;
+	do
+	{
+		Section = NextFreeGap(Map,Section,FlashSize,&Start,&End);
+		if ((Needed <= Free) && (End > Start))
+			printf("0x%07lX - 0x%07lX : 0x%lx bytes\n",Start,End,End-Start);
+	} while (Section != NULL);
+
+	free(Order);
+	return nFailed;
+}
+
+/* String table of a layout plan being compiled */
+typedef struct
+{
+	char *Data;
+	UINT32 Size;
+	UINT32 Alloc;
+	int Failed;
+} PLAN_STRINGS;
+
+static
+UINT32
+AddPlanString(PLAN_STRINGS *Str,char *Val)
+{
+	UINT32 Len,Off;
+	char *New;
+
+	if (Val == NULL)
+		return PLAN_NOSTR;
+	Len = strlen(Val)+1;
+	if (Str->Size+Len > Str->Alloc)
+	{
+		New = (char *)realloc(Str->Data,Str->Alloc+Len+4096);
+		if (New == NULL)
+		{
+			Str->Failed = 1;
+			return PLAN_NOSTR;
+		}
+		Str->Data = New;
+		Str->Alloc += Len+4096;
+	}
+	Off = Str->Size;
+	memcpy(&Str->Data[Off],Val,Len);
+	Str->Size += Len;
+	return Off;
+}
+
+static
+char *
+PlanStr(LAYOUT_PLAN *Plan,UINT32 Off)
+{
+	if (Off == PLAN_NOSTR)
+		return NULL;
+	return &Plan->Str[Off];
+}
+
+static
+void
+SetPlanPointers(LAYOUT_PLAN *Plan,unsigned char *Base,UINT32 Size)
+{
+	Plan->Hdr = (LAYOUT_HEADER *)Base;
+	Plan->Sec = (LAYOUT_SECTION *)(Base+sizeof(LAYOUT_HEADER));
+	Plan->Globals = (UINT32 *)&Plan->Sec[Plan->Hdr->nSections];
+	Plan->Str = (char *)&Plan->Globals[2*Plan->Hdr->nGlobals];
+	Plan->Size = Size;
+}
+
+void
+FreeLayoutPlan(LAYOUT_PLAN *Plan)
+{
+	if (Plan->Hdr == NULL)
+		return;
+	if (Plan->Mapped)
+		munmap(Plan->Hdr,Plan->Size);
+	else
+		free(Plan->Hdr);
+	Plan->Hdr = NULL;
+}
+
+/* Compile the config into a layout plan: the global values and, for each
+ * section, everything read from the config with its defaults applied.
+ * Returns -1 if the config cannot be used at all, else the number of
+ * sections with a missing File or Locate (reported when building) */
+int
+CompileLayoutPlan(dictionary *d,LAYOUT_PLAN *Plan)
+{
+	LAYOUT_HEADER Hdr;
+	LAYOUT_SECTION *Sections,*Sect;
+	UINT32 *Globals;
+	PLAN_STRINGS Str;
+	inisection Sec;
+	MODULE_INFO mod;
+	unsigned char ModuleFormat;
+	char *SecName,*OutFile,*LocationStr,*Placement;
+	int nsecs,nBad,i,it,GlobalSec;
+	UINT32 nGlobals,Size;
+	unsigned char *Base;
+
+	memset(&Hdr,0,sizeof(LAYOUT_HEADER));
+	memset(&Str,0,sizeof(PLAN_STRINGS));
+	strcpy(Hdr.Magic,PLAN_MAGIC);
+
+	/* Get the global information */
+	OutFile = iniparser_getstr(d,"GLOBAL:Output");
+	if (OutFile == NULL)
+	{
+		printf("Error: Unable to get Output file name\n");
+		return -1;
+	}
+	Hdr.FlashSize = iniparser_getlong(d,"GLOBAL:FlashSize",0);
+	if (Hdr.FlashSize == 0)
+	{
+		printf("Error: Unable to get Flash Size\n");
+		return -1;
+	}	
+	Hdr.BlockSize = iniparser_getlong(d,"GLOBAL:BlockSize",0);
+	if (Hdr.BlockSize == 0)
+	{
+		printf("Error: Unable to get Block Size\n");
+		return -1;
+	}	
+	Hdr.UseFMH = (iniparser_getlong(d,"GLOBAL:FMHEnable",1) != 0);
+	Placement = iniparser_getstring(d,"GLOBAL:Placement","FirstFit");
+	if (strcasecmp(Placement,"FirstFit") == 0)
+		Hdr.Placement = PLACE_FIRSTFIT;
+	else if (strcasecmp(Placement,"BestFit") == 0)
+		Hdr.Placement = PLACE_BESTFIT;
+	else if (strcasecmp(Placement,"Aligned") == 0)
+		Hdr.Placement = PLACE_ALIGNED;
+	else
+	{
+		printf("Error: Unknown Placement %s (FirstFit, BestFit or Aligned)\n",Placement);
+		return -1;
+	}
+	Hdr.Output = AddPlanString(&Str,OutFile);
+	Hdr.OutDir = AddPlanString(&Str,iniparser_getstr(d,"GLOBAL:OutDir"));
+
+	/* The GLOBAL entries are kept for the firmware information */
+	nsecs = iniparser_getnsec(d);
+	GlobalSec = -1;
+	nGlobals = 0;
+	for (i=0;i<nsecs;i++)
+	{
+		SecName = iniparser_getsecname(d,i);
+		if (SecName == NULL)
+		{
+			printf("ERROR: Unable to get Name for Section %d\n",i);
+			free(Str.Data);
+			return -1;
+		}
+		if (strcasecmp(SecName,"GLOBAL") == 0)
+			GlobalSec = i;
+	}
+	for (it=iniparser_secfirst(d,GlobalSec);it>=0;it=iniparser_secnext(d,it))
+		nGlobals++;
+
+	Sections = (LAYOUT_SECTION *)calloc(nsecs+1,sizeof(LAYOUT_SECTION));
+	Globals = (UINT32 *)calloc(2*nGlobals+1,sizeof(UINT32));
+	if ((Sections == NULL) || (Globals == NULL))
+	{
+		printf("INTERNAL ERROR: Unable to allocate memory for layout plan\n");
+		free(Sections);
+		free(Globals);
+		free(Str.Data);
+		return -1;
+	}
+	nGlobals = 0;
+	for (it=iniparser_secfirst(d,GlobalSec);it>=0;it=iniparser_secnext(d,it))
+	{
+		Globals[2*nGlobals] = AddPlanString(&Str,iniparser_iterkey(d,it));
+		Globals[2*nGlobals+1] = AddPlanString(&Str,iniparser_iterval(d,it));
+		nGlobals++;
+	}
+
+	nBad = 0;
+	for(i=0;i<nsecs;i++)
+	{
+		/* Skip GLOBAL Section. We already processed it */
+		if (i == GlobalSec)
+			continue;
+		SecName = iniparser_getsecname(d,i);
+		Sec = iniparser_section(d,SecName);
+		Sect = &Sections[Hdr.nSections++];
+		memset(&mod,0,sizeof(MODULE_INFO));
+		Sect->Name = AddPlanString(&Str,SecName);
+
+		/* Get Module Version */
+		mod.Module_Ver_Major = section_getint(Sec,"major",0); 
+		mod.Module_Ver_Minor = section_getint(Sec,"minor",0); 
+
+		/* Get Module Type */
+		mod.Module_Type = section_getint(Sec,"type",0x0000);
+		ModuleFormat = (mod.Module_Type >> 8);
+		
+		/* Check if altFMH to be used */		
+		Sect->FMHLoc = section_getlong(Sec,"fmhloc",0);
+		/* Get Module Location . Default is 0x40 for normal section 
+		 * and one block size for JFFS/JFFS2 */
+		/* If Alternate FMH to be used, offset will be 0 if not specified */
+		if (Sect->FMHLoc != 0)
+			mod.Module_Location = section_getlong(Sec,"offset",0);		
+		else
+		{
+		if ((mod.Module_Type == MODULE_JFFS) || (mod.Module_Type == MODULE_JFFS2)||
+		    (mod.Module_Type == MODULE_JFFS_CONFIG) ||
+		    (mod.Module_Type == MODULE_JFFS2_CONFIG) ||
+		    (ModuleFormat == MODULE_FORMAT_JFFS) ||
+		    (ModuleFormat == MODULE_FORMAT_JFFS2))
+			mod.Module_Location = section_getlong(Sec,"offset",Hdr.BlockSize);		
+		else
+			mod.Module_Location = section_getlong(Sec,"offset",0x40);		
+		}
+		if (!Hdr.UseFMH)
+			mod.Module_Location = 0;
+		
+
+		/* Get Flags */
+		if (section_getboolean(Sec,"bootos",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_OS;
+		if (section_getboolean(Sec,"bootdiag",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_DIAG;
+		if (section_getboolean(Sec,"bootreco",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_BOOTPATH_RECOVERY;
+		if (section_getboolean(Sec,"copytoram",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_COPY_TO_RAM;
+		if (section_getboolean(Sec,"execute",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_EXECUTE;
+		if (section_getboolean(Sec,"checksum",0) == 1)
+			mod.Module_Flags |= MODULE_FLAG_VALID_CHECKSUM;
+		mod.Module_Flags |= section_getint(Sec,"compress",0x00) 
+							<< MODULE_FLAG_COMPRESSION_LSHIFT;
+
+		/* Get Load Address */
+		mod.Module_Load_Address = section_getlong(Sec,"load",0xFFFFFFFF);
+		if (mod.Module_Load_Address == 0xFFFFFFFF)
+			mod.Module_Flags &= (~MODULE_FLAG_COPY_TO_RAM);
+
+		/* Get Allocation Size */
+		Sect->Alloc = section_getlong(Sec,"alloc",0);
+
+		/* Module Firmware is a dummy section. It does not have any data */
+		Sect->File = PLAN_NOSTR;
+		if ((mod.Module_Type == MODULE_FMH_FIRMWARE) || 
+		    (mod.Module_Type == MODULE_FIRMWARE_1_4))
+			Sect->Alloc = Hdr.BlockSize;
+		else
+		{
+			Sect->File = AddPlanString(&Str,section_getstr(Sec,"file"));
+			if (Sect->File == PLAN_NOSTR)
+				nBad++;
+		}
+
+		/* Flash Location can be either START, END, AUTO or numeric value */
+		Sect->LocateKind = LOCATE_NONE;
+		LocationStr = section_getstr(Sec,"locate");
+		if (LocationStr == NULL)
+			Sect->LocateKind = LOCATE_NONE;
+		else if (strcasecmp(LocationStr,"START") == 0)
+		{
+			Sect->LocateKind = LOCATE_ADDR;
+			Sect->Locate = 0;
+		}
+		else if (strcasecmp(LocationStr,"END") == 0)
+			Sect->LocateKind = LOCATE_END;
+		else if (strcasecmp(LocationStr,"AUTO") == 0)
+			Sect->LocateKind = LOCATE_AUTO;
+		else
+		{
+			Sect->Locate = section_getlong(Sec,"locate",0xFFFFFFFF);
+			if (Sect->Locate != 0xFFFFFFFF)
+				Sect->LocateKind = LOCATE_ADDR;
+		}
+		if (Sect->LocateKind == LOCATE_NONE)
+			nBad++;
+
+		Sect->Type = mod.Module_Type;
+		Sect->Major = mod.Module_Ver_Major;
+		Sect->Minor = mod.Module_Ver_Minor;
+		Sect->Flags = mod.Module_Flags;
+		Sect->Offset = mod.Module_Location;
+		Sect->Load = mod.Module_Load_Address;
+	}
+
+	/* Lay the plan out as it is stored */
+	Hdr.nGlobals = nGlobals;
+	Hdr.StrSize = Str.Size;
+	Size = sizeof(LAYOUT_HEADER) + (Hdr.nSections * sizeof(LAYOUT_SECTION)) +
+						(2 * nGlobals * sizeof(UINT32)) + Str.Size;
+	Hdr.PlanSize = Size;
+	Base = (unsigned char *)malloc(Size);
+	if ((Base == NULL) || (Str.Failed))
+	{
+		printf("INTERNAL ERROR: Unable to allocate memory for layout plan\n");
+		free(Base);
+		free(Sections);
+		free(Globals);
+		free(Str.Data);
+		return -1;
+	}
+	memcpy(Base,&Hdr,sizeof(LAYOUT_HEADER));
+	SetPlanPointers(Plan,Base,Size);
+	Plan->Mapped = 0;
+	memcpy(Plan->Sec,Sections,Hdr.nSections * sizeof(LAYOUT_SECTION));
+	memcpy(Plan->Globals,Globals,2 * nGlobals * sizeof(UINT32));
+	memcpy(Plan->Str,Str.Data,Str.Size);
+	free(Sections);
+	free(Globals);
+	free(Str.Data);
+	return nBad;
+}
+
+static
+int
+BadPlanString(LAYOUT_PLAN *Plan,UINT32 Off,int Optional)
+{
+	if (Off == PLAN_NOSTR)
+		return !Optional;
+	return (Off >= Plan->Hdr->StrSize);
+}
+
+/* Map the layout plan of a config file. The plan is used only if it was
+ * compiled from a config of the same size and CRC32 */
+int
+MapLayoutPlan(char *PlanName,UINT32 IniSize,UINT32 IniCRC,LAYOUT_PLAN *Plan)
+{
+	LAYOUT_HEADER *Hdr;
+	struct stat Stat;
+	unsigned char *Base;
+	UINT32 Fixed,s,g;
+	int fd;
+
+	fd = open(PlanName,O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if ((fstat(fd,&Stat) != 0) || (Stat.st_size < (off_t)sizeof(LAYOUT_HEADER)) ||
+	    (Stat.st_size > 0x7FFFFFFF))
+	{
+		close(fd);
+		return 1;
+	}
+	Base = mmap(NULL,Stat.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (Base == MAP_FAILED)
+		return 1;
+
+	/* Check that the plan is complete before looking inside */
+	Hdr = (LAYOUT_HEADER *)Base;
+	if ((memcmp(Hdr->Magic,PLAN_MAGIC,sizeof(PLAN_MAGIC)) != 0) ||
+	    (Hdr->IniSize != IniSize) || (Hdr->IniCRC != IniCRC) ||
+	    (Hdr->PlanSize != Stat.st_size) || (Hdr->StrSize == 0) ||
+	    (Hdr->nSections > Hdr->PlanSize/sizeof(LAYOUT_SECTION)) ||
+	    (Hdr->nGlobals > Hdr->PlanSize/(2*sizeof(UINT32))))
+	{
+		munmap(Base,Stat.st_size);
+		return 1;
+	}
+	Fixed = sizeof(LAYOUT_HEADER) + (Hdr->nSections * sizeof(LAYOUT_SECTION)) +
+							(2 * Hdr->nGlobals * sizeof(UINT32));
+	if ((Fixed >= Hdr->PlanSize) || (Hdr->PlanSize - Fixed != Hdr->StrSize))
+	{
+		munmap(Base,Stat.st_size);
+		return 1;
+	}
+	SetPlanPointers(Plan,Base,Hdr->PlanSize);
+	Plan->Mapped = 1;
+
+	/* All strings must be in the string table */
+	if ((Plan->Str[Hdr->StrSize-1] != 0) || BadPlanString(Plan,Hdr->Output,0) ||
+	    BadPlanString(Plan,Hdr->OutDir,1))
+	{
+		FreeLayoutPlan(Plan);
+		return 1;
+	}
+	for (s=0;s<Hdr->nSections;s++)
+	{
+		if (BadPlanString(Plan,Plan->Sec[s].Name,0) ||
+		    BadPlanString(Plan,Plan->Sec[s].File,1))
+		{
+			FreeLayoutPlan(Plan);
+			return 1;
+		}
+	}
+	for (g=0;g<Hdr->nGlobals;g++)
+	{
+		if (BadPlanString(Plan,Plan->Globals[2*g],0) ||
+		    BadPlanString(Plan,Plan->Globals[2*g+1],1))
+		{
+			FreeLayoutPlan(Plan);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Write the layout plan. Like the checksum cache, it is replaced with a
+ * rename */
+int
+SaveLayoutPlan(char *PlanName,LAYOUT_PLAN *Plan)
+{
+	FILE *fd;
+	char TmpFile[sizeof(PlanFile)+16];
+
+	sprintf(TmpFile,"%s.%d",PlanName,(int)getpid());
+	fd = fopen(TmpFile,"wb");
+	if (fd == NULL)
+		return 1;
+
+	if (fwrite(Plan->Hdr,1,Plan->Size,fd) != Plan->Size)
+	{
+		fclose(fd);
+		unlink(TmpFile);
+		return 1;
+	}
+	if (fclose(fd) != 0)
+	{
+		unlink(TmpFile);
+		return 1;
+	}
+	if (rename(TmpFile,PlanName) != 0)
+	{
+		unlink(TmpFile);
+		return 1;
+	}
+	return 0;
+}
+
+/* Size and CRC32 of the config file, which key its layout plan */
+static
+int
+IniFileCRC(char *ini_name,UINT32 *Size,UINT32 *crc32)
+{
+	struct stat Stat;
+	unsigned char *Data;
+	int fd;
+
+	/* A pipe or FIFO can only be read once, leave it to the parser */
+	if ((stat(ini_name,&Stat) != 0) || (!S_ISREG(Stat.st_mode)))
+		return 1;
+	fd = open(ini_name,O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if ((fstat(fd,&Stat) != 0) || (Stat.st_size == 0) || (Stat.st_size > 0x7FFFFFFF))
+	{
+		close(fd);
+		return 1;
+	}
+	Data = mmap(NULL,Stat.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (Data == MAP_FAILED)
+		return 1;
+	*Size = Stat.st_size;
+	*crc32 = CalculateCRC32(Data,*Size);
+	munmap(Data,Stat.st_size);
+	return 0;
+}
+
+/* Dictionary of the GLOBAL entries of a plan, for the firmware information */
+static
+dictionary *
+PlanGlobals(LAYOUT_PLAN *Plan)
+{
+	dictionary *d;
+	char Key[1024+8];
+	UINT32 g;
+
+	d = dictionary_new(0);
+	if (d == NULL)
+		return NULL;
+	dictionary_set(d,"global",NULL);
+	for (g=0;g<Plan->Hdr->nGlobals;g++)
+	{
+		snprintf(Key,sizeof(Key),"global:%s",PlanStr(Plan,Plan->Globals[2*g]));
+		dictionary_set(d,Key,PlanStr(Plan,Plan->Globals[2*g+1]));
+	}
+	return d;
+}
+
+/* Get the layout plan of the config file. The plan compiled by a previous
+ * run is mapped as is, so an unchanged config is neither parsed nor checked
+ * again. Else the config is parsed, compiled and the plan saved beside it */
+int
+LoadLayout(char *ini_name,LAYOUT_PLAN *Plan,dictionary **pd)
+{
+	dictionary *d;
+	UINT32 IniSize = 0,IniCRC = 0;
+	int nBad;
+
+	PlanFile[0] = 0;
+	if ((strlen(ini_name) < 256) && (IniFileCRC(ini_name,&IniSize,&IniCRC) == 0))
+	{
+		sprintf(PlanFile,"%s%s",ini_name,PLAN_SUFFIX);
+		if (MapLayoutPlan(PlanFile,IniSize,IniCRC,Plan) == 0)
+		{
+			*pd = PlanGlobals(Plan);
+			if (*pd != NULL)
+				return 0;
+			FreeLayoutPlan(Plan);
+		}
+	}
+
+	/*Load the ini File into dictionary*/	
+	d = iniparser_load(ini_name);
+	if (d==NULL) 
+	{
+		printf("Error:Cannot parse file [%s]\n", ini_name);
+		return 1 ;
+	}
+#if DEBUG	
+	iniparser_dump(d, stderr);
+#endif	
+
+	nBad = CompileLayoutPlan(d,Plan);
+	if (nBad < 0)
+	{
+		iniparser_freedict(d);
+		return 1;
+	}
+	Plan->Hdr->IniSize = IniSize;
+	Plan->Hdr->IniCRC = IniCRC;
+
+	/* The errors of an invalid config are reported on every run. A dry
+	 * run (--plan) writes nothing, not even the plan */
+	if ((nBad == 0) && (PlanFile[0] != 0) && (!CmdDryRun) &&
+	    (SaveLayoutPlan(PlanFile,Plan) != 0))
+		printf("WARNING: Unable to save layout plan %s\n",PlanFile);
+	*pd = d;
+	return 0;
+}
+
+
+/* Open the output image, sized to the flash. With --update an existing
+ * image of the same flash is opened as it is, to be updated in place */
+static
+FILE *
+OpenOutputImage(char *OutFile,UINT32 FlashSize,UINT32 BlockSize,int UseFMH)
+{
+	FILE *Outfd;
+	struct stat OutStat;
+
+	/* An image of the same flash can be updated in place */
+	Outfd = NULL;
+	if (CmdUpdate && UseFMH)
+	{
+		Outfd = fopen(OutFile,"r+b");
+		if ((Outfd != NULL) && ((fstat(fileno(Outfd),&OutStat) != 0) || 
+					(OutStat.st_size != FlashSize)))
+		{
+			fclose(Outfd);
+			Outfd = NULL;
+		}
+		if (Outfd == NULL)
+			printf("INFO: No previous image to update. Creating a new one\n");
+	}
+
+	/* Create and open the output file */
+	if (Outfd == NULL)
+		Outfd = fopen(OutFile,"w+b");
+	else
+		gUpdating = 1;
+	if (Outfd == NULL)
+	{
+		printf("Error: Unable to get Create Output file %s\n",OutFile);
+		return NULL;
+	}
+	/* Size (and if possible reserve) the image. The erased (0xFF) areas
+	 * are filled once all sections are placed, so that no byte covered
+	 * by a module is written twice */
+	if ((!gUpdating) && (ftruncate(fileno(Outfd),FlashSize) != 0))
+	{
+		printf("Error: Unable to set size of Output file %s\n",OutFile);
+		fclose(Outfd);
+		return NULL;
+	}
+	posix_fallocate(fileno(Outfd),0,FlashSize);
+
+	/* Map the whole image if requested. All the writes go through the
+	 * mapping, which is synced once the image is complete */
+	if (CmdMapOutput)
+	{
+		gImageMap = mmap(NULL,FlashSize,PROT_READ|PROT_WRITE,MAP_SHARED,
+								fileno(Outfd),0);
+		if (gImageMap == MAP_FAILED)
+		{
+			gImageMap = NULL;
+			printf("Error: Unable to map Output file %s\n",OutFile);
+			fclose(Outfd);
+			return NULL;
+		}
+		gImageSize = FlashSize;
+		madvise(gImageMap,FlashSize,MADV_SEQUENTIAL);
+	}
+
+	/* Find what is in the image being updated */
+	if (gUpdating && 
+	    ((gnOldSections = ScanOldImage(Outfd,FlashSize,BlockSize,&gOldSections)) == 0))
+	{
+		printf("INFO: Unable to find the sections of %s. Creating a new one\n",OutFile);
+		gUpdating = 0;
+	}
+	return Outfd;
+}
+
+int 
+ParseIniFile(char* ini_name)
+{
+	/* INI Parser Related */
+	dictionary *d;			/* Dictionary */
+	LAYOUT_PLAN Plan;		/* Layout compiled from the config */
+	LAYOUT_SECTION *Sect;	/* Current section of the plan */
+	int nsecs,i,j;			/* Number of Sections */
+	char *SecName;			/* Section Name */
+	
+	/* Global Information */	
+	char *OutFile;			/* Output Bin File */
+	INT32 FlashSize;			/* Size of Flash */
+	INT32 BlockSize;			/* Size of each Flash Block */
+	char *InDir;			/* Location of Input Files */
+	char *OutDir;			/* Location of Output File */
+
+	/* Output File Creation Related */	
+	FILE *Outfd;			/* Output File Descriptor */
+	SECTION_MAP UsedMap;	/* Used for checking overlapping sections */
+
+	/* FMH Related */
+	MODULE_INFO mod;		/* Module Information */
+	CRC_CACHE_ENTRY *Cached;	/* Checksum cache entry of the module */
+	char *InFile;			/* Input File for FMH Section */
+	UINT32 InFileSize; /* Size of Section File */
+	UINT32 AllocSize;/* Total Allocation Size for this FMH */
+	UINT32 MinAllocSize;/* Mininmum Calculated Allocation Size */
+	UINT32 FMHLoc;	/* Alternate FMH Location */
+	UINT32 Location;	/* Flash Location Value */
+
+	/* RACTRENDS releted */
+	char *BuildFile;		/* Build Number File */
+	char *VersionStr;		/* Major and Minor String */
+	int FirmwareMajor,FirmwareMinor;
+	unsigned long ImageHeaderStart = 0xFFFFFFFF; /* This points to the MODULE FIRMWARE start address */
+	int UseFMH=1;
+
+	/* Sections resolved from the plan, before they are written */
+	MODULE_JOB *Layout;
+	MODULE_JOB *Job;
+	int nLayout = 0,k;
+
+	/* Parallel module copy (-j) */
+	MODULE_JOB *Jobs = NULL;
+	int nJobs = 0;
+
+	/* In place update (--update) */
+	int nKept = 0;
+
+	/* Dry run (--plan) */
+	UINT32 crc32,ImageCRC = 0;
+	int HaveImageCRC = 0;
+
+	/* Get the layout, from its plan or from the ini File */
+	if (LoadLayout(ini_name,&Plan,&d) != 0)
+		return 1;
+
+	/* Get the global information */
+	OutFile = PlanStr(&Plan,Plan.Hdr->Output);
+	FlashSize = Plan.Hdr->FlashSize;
+	BlockSize = Plan.Hdr->BlockSize;
+	gBlkSize = BlockSize;
+
+	UseFMH = Plan.Hdr->UseFMH;
+	printf("The Image file %s have FMH\n",UseFMH?"will":"will not");
+
+	/* Get the Input and Output Directory Path */
+	if (CmdOutDir[0] == 0)
+		OutDir = PlanStr(&Plan,Plan.Hdr->OutDir);
+	else
+		OutDir = &CmdOutDir[0];
+	
+	if (CmdInDir[0] == 0)
+		InDir  = PlanStr(&Plan,Plan.Hdr->OutDir);
+	else
+		InDir = &CmdInDir[0];
+
+	/* Convert OutputFile to Full Path */
+	OutFile = Convert2FullPath(OutDir,OutFile);
+
+	/* Load the checksum cache of the previous builds */
+	CRCCacheFile[0] = 0;
+	if ((!CmdNoCache) && (strlen(OutFile) < 256))
+	{
+		sprintf(CRCCacheFile,"%s%s",OutFile,CRC_CACHE_SUFFIX);
+		LoadCRCCache(CRCCacheFile);
+	}
+
+	/* Read the previous release before the output can replace it */
+	if ((CmdRefFile[0] != 0) && (LoadReferenceImage(CmdRefFile,FlashSize,BlockSize) != 0))
+	{
+		iniparser_freedict(d);
+		FreeLayoutPlan(&Plan);
+		return 1;
+	}
+
+	printf("\n%s \"%s\" ...\n",CmdDryRun ? "Planning" : "Creating",OutFile);
+	printf("FlashSize = 0x%lx BlockSize = 0x%lx\n",FlashSize,BlockSize);
+	
+	/* A dry run (--plan) does not touch the output file */
+	Outfd = NULL;
+	if ((!CmdDryRun) && 
+	    ((Outfd = OpenOutputImage(OutFile,FlashSize,BlockSize,UseFMH)) == NULL))
+	{
+		iniparser_freedict(d);
+		FreeLayoutPlan(&Plan);
+		return 1;
+	}
+
+	/* Initialize */
+	memset(&UsedMap,0,sizeof(SECTION_MAP));
+
+	/* Get the number of sections */
+	nsecs = Plan.Hdr->nSections;
+	if (CmdJobs > 1)
+		Jobs = (MODULE_JOB *)calloc(nsecs,sizeof(MODULE_JOB));
+	Layout = (MODULE_JOB *)calloc(nsecs+1,sizeof(MODULE_JOB));
+	if (Layout == NULL)
+		printf("INTERNAL ERROR: Unable to allocate memory for Layout\n");
+	for(i=0;(Layout != NULL) && (i<nsecs);i++)
+	{
+		memset(&mod,0,sizeof(MODULE_INFO));
+		Cached = NULL;
+		InFile = NULL;
+		Sect = &Plan.Sec[i];
+		SecName = PlanStr(&Plan,Sect->Name);
+		
+		/* Save Section Name in Module Information. Strip to max 8 characters */
+		if (strlen(SecName) > 8)
+			strncpy((char *)mod.Module_Name,SecName,8);
+		else
+			strcpy((char *)mod.Module_Name,SecName);		
+
+		/* Module information, with the defaults already applied */
+		mod.Module_Ver_Major = Sect->Major; 
+		mod.Module_Ver_Minor = Sect->Minor; 
+		mod.Module_Type = Sect->Type;
+		mod.Module_Location = Sect->Offset;
+		mod.Module_Flags = Sect->Flags;
+		mod.Module_Load_Address = Sect->Load;
+		FMHLoc = Sect->FMHLoc;
+		AllocSize = Sect->Alloc;
+			
+		/* Module Firmware is a dummy section. It does not have any data */
 		if ((mod.Module_Type != MODULE_FMH_FIRMWARE) &&
 		    (mod.Module_Type != MODULE_FIRMWARE_1_4))
 		{
 			/* Check for mandatory Field - Input File Name */
-			sprintf(Key,"%s:File",SecName);
-			InFile = iniparser_getstr(d,Key);
+			InFile = PlanStr(&Plan,Sect->File);
 			if (InFile == NULL)
 			{
 				printf("ERROR: Unable to get Input file for Section %s\n",SecName);
@@ -471,347 +1706,1592 @@ ParseIniFile(char* ini_name)
 			printf("Input File = [%s]\n",InFile);
 #endif			
 			
-			/* Fill the remaining Fields of MODULE_INFO - Size, Checksum*/
-			InFileSize  = FillModuleInfo(&mod,InFile);
-			if (InFileSize == 0)
-			{
-				printf("ERROR: Input file (%s) size for section %s is 0\n",InFile,SecName);
-				break;
-			}
+			/* Get the module size. The checksum is filled when the
+			 * module is copied to the output */
+			InFileSize  = FillModuleInfo(&mod,InFile,&Cached);
+			if (InFileSize == 0)
+			{
+				printf("ERROR: Input file (%s) size for section %s is 0\n",InFile,SecName);
+				break;
+			}
+
+#if 0			
+			/* For JFFS and JFFS2, it should be a multiple of BlockSize */
+			/* Otherwise the mtd will be mounted read only */
+			if ((mod.Module_Type == MODULE_JFFS) || 
+							(mod.Module_Type == MODULE_JFFS2))
+			{		
+				InFileSize = (InFileSize+BlockSize-1);
+				InFileSize = (InFileSize/BlockSize) * BlockSize;
+			}
+#endif
+			
+			mod.Module_Size = InFileSize;
+			
+			/* Calculate the Min Allocation Size */
+			MinAllocSize = mod.Module_Location + InFileSize;			
+			MinAllocSize += (BlockSize-1);
+			MinAllocSize = (MinAllocSize/BlockSize) * BlockSize;
+
+			if (AllocSize != 0)
+			{
+				if (AllocSize < MinAllocSize)
+					printf("WARNING: Section %s size exceeds the Allocated Size\n",SecName);
+			}
+
+			if (AllocSize < MinAllocSize)
+				AllocSize = MinAllocSize;
+			
+		}
+		else
+		{
+			/* Check if Firmware version is overridden by Build script */
+			VersionStr = getenv("FW_MAJOR");
+			if (VersionStr != NULL)
+			{
+				if (sscanf(VersionStr,"%d",&FirmwareMajor) == 1)
+					mod.Module_Ver_Major = (unsigned char)FirmwareMajor;
+			}
+
+			VersionStr = getenv("FW_MINOR");
+			if (VersionStr != NULL)
+			{
+				if (sscanf(VersionStr,"%d",&FirmwareMinor) == 1)
+					mod.Module_Ver_Minor = (unsigned char)FirmwareMinor;
+			}
+			
+			/* For Ractrends Series Firmware Section has some vendor specific Info */
+			BuildFile = Convert2FullPath(OutDir,"BUILDNO");
+			mod.Module_Size = CreateFirmwareInfo(&FirmwareInfo[0],BuildFile,
+										mod.Module_Ver_Major,mod.Module_Ver_Minor,d);
+										
+			if (mod.Module_Size > ((64*1024) - 0x40))
+				mod.Module_Size = 0;
+		}
+	
+		/* Get Flash Location. END is resolved now that the size is known,
+		 * AUTO once all the other sections are in place */
+		if (Sect->LocateKind == LOCATE_NONE)
+		{
+			printf("ERROR: Unable to get Module Location in Flash for %s\n",SecName);
+			break;
+		}
+		Location = Sect->Locate;
+		if (Sect->LocateKind == LOCATE_END)
+			Location = FlashSize-AllocSize;
+
+		Job = &Layout[nLayout];
+		if (Sect->LocateKind != LOCATE_AUTO)
+		{
+			/* Validate Location */
+			if ((Location > FlashSize) || (Location+AllocSize > FlashSize))
+			{
+				printf("ERROR: Module Location %ld, Alloc %ld,  > Flash %ld for %s\n",
+								Location,AllocSize,FlashSize,SecName);
+				break;
+			}
+
+			/* Check for overlapping sections and add location and size 
+			 * and section name to the map of used areas */
+			if (AddSection(&UsedMap,Location,AllocSize,SecName,
+						mod.Module_Ver_Major,mod.Module_Ver_Minor,&Job->Section) != 0)
+				break;
+		}
+
+		Job->SecName = SecName;
+		Job->Location = Location;
+		Job->AllocSize = AllocSize;
+		Job->FMHLoc = FMHLoc;
+		memcpy(&Job->Mod,&mod,sizeof(MODULE_INFO));
+		Job->Cached = Cached;
+		nLayout++;
+		if (InFile != NULL)
+		{
+			Job->InFile = strdup(InFile);
+			if (Job->InFile == NULL)
+			{
+				printf("ERROR: Out of memory for Section %s\n",SecName);
+				break;
+			}
+		}
+	}
+	if (i == nsecs)
+	{
+		/* Place the Locate = AUTO sections around the others, where
+		 * the previous release has them if possible */
+		if (gnRefSections != 0)
+			PlaceFromReference(&UsedMap,Layout,nLayout,FlashSize);
+		if (PlaceAutoSections(&UsedMap,Layout,nLayout,FlashSize,BlockSize,
+										Plan.Hdr->Placement) != 0)
+			i = -1;		/* Mark the image as failed */
+	}
+
+	/* Write the sections that have a place in Flash, in section order */
+	for (k=0;k<nLayout;k++)
+	{
+		Job = &Layout[k];
+		if (Job->Section == NULL)
+			continue;
+
+		/* Nothing to write if the previous image has the same section */
+		if (gUpdating && (Job->Mod.Module_Type != MODULE_FMH_FIRMWARE) &&
+		    (Job->Mod.Module_Type != MODULE_FIRMWARE_1_4) &&
+		    (KeepOldSection(Job->Section,&Job->Mod,Job->InFile,Job->Location,
+					Job->AllocSize,Job->FMHLoc,Job->Cached) == 0))
+		{
+			nKept++;
+			if (FinishSection(Outfd,Job->Section,Job->SecName,&Job->Mod,Job->Location,
+						Job->AllocSize,Job->FMHLoc,UseFMH,BlockSize) != 0)
+			{
+				i = -1;		/* Mark the image as failed */
+				break;
+			}
+			continue;
+		}
+
+		if ((Job->Mod.Module_Type != MODULE_FMH_FIRMWARE) &&
+		    (Job->Mod.Module_Type != MODULE_FIRMWARE_1_4))
+		{
+			/* A dry run only needs the module checksum */
+			if (CmdDryRun)
+			{
+				if (CachedModuleCRC(Job->InFile,Job->Mod.Module_Size,Job->Cached,&crc32) != 0)
+				{
+					printf("ERROR: Unable to read Module of Section %s\n",Job->SecName);
+					i = -1;		/* Mark the image as failed */
+					break;
+				}
+				Job->Mod.Module_Checksum = crc32;
+			}
+			/* Sections do not overlap, so the module can be copied by a
+			 * worker while the other sections are written */
+			else if (Jobs != NULL)
+			{
+				memcpy(&Jobs[nJobs++],Job,sizeof(MODULE_JOB));
+				continue;
+			}
+			/* Copy the module and fill its checksum in the same pass */
+			else if (WriteModuletoFile(Outfd,Job->InFile,Job->Location+Job->Mod.Module_Location,
+										&Job->Mod,Job->Cached)!= 0)
+			{
+				printf("ERROR: Unable to Write Module of Section %s\n",Job->SecName);
+				i = -1;		/* Mark the image as failed */
+				break;
+			}
+		}
+		else
+		{
+			if (Job->Mod.Module_Size == 0)
+				printf("INFO: No Firmware Information written to FIRMWARE Section\n");	
+			else if ((!CmdDryRun) && 
+				 (WriteFirmwareInfo(Outfd,(char *)FirmwareInfo,Job->Mod.Module_Size,
+										Job->Location+Job->Mod.Module_Location)!= 0))
+			{
+				printf("ERROR: Unable to Write Firmware Info in Section %s\n",Job->SecName);
+				i = -1;		/* Mark the image as failed */
+				break;
+			}	
+			ImageHeaderStart = Job->Location;			
+		}
+
+		/* Create and write FMH and Alternate FMH, now that the
+		 * module checksum is known */
+		if (FinishSection(Outfd,Job->Section,Job->SecName,&Job->Mod,Job->Location,
+						Job->AllocSize,Job->FMHLoc,UseFMH,BlockSize) != 0)
+		{
+			i = -1;		/* Mark the image as failed */
+			break;
+		}
+	}
+
+	/* Copy the queued modules and write their FMHs, in section order */
+	if (nJobs != 0)
+	{
+		RunModuleJobs(Outfd,Jobs,nJobs,CmdJobs);
+		for (j=0;j<nJobs;j++)
+		{
+			if (Jobs[j].Status != 0)
+			{
+				printf("ERROR: Unable to Write Module of Section %s\n",Jobs[j].SecName);
+				i = -1;		/* Mark the image as failed */
+				break;
+			}
+			if (FinishSection(Outfd,Jobs[j].Section,Jobs[j].SecName,&Jobs[j].Mod,
+						Jobs[j].Location,Jobs[j].AllocSize,Jobs[j].FMHLoc,
+											UseFMH,BlockSize) != 0)
+			{
+				i = -1;		/* Mark the image as failed */
+				break;
+			}
+		}
+	}
+	for (k=0;k<nLayout;k++)
+		free(Layout[k].InFile);
+	free(Layout);
+	free(Jobs);
+
+	if (gUpdating)
+		printf("Updated in place: %d section(s) unchanged\n",nKept);
+
+	/* Erase everything that no section wrote to */
+	if ((!CmdDryRun) && (EraseUnusedFlash(Outfd,&UsedMap,FlashSize) != 0))
+	{
+		printf("ERROR: Unable to erase the unused Flash areas\n");
+		i = -1;		/* Mark the image as failed */
+	}
+
+	/* Calculate complete image checksum now and fill in the MODULE INFO checksum field */
+	if (ImageHeaderStart != 0xFFFFFFFF)
+	{
+		if (CmdDryRun)
+		{
+			/* Without an image, only what the section map describes */
+			if ((i == nsecs) && 
+			    (PlanImageChecksum(&UsedMap,ImageHeaderStart,&ImageCRC) == 0))
+				HaveImageCRC = 1;
+			else
+				printf("WARNING: Image checksum needs the image to be written\n");
+		}
+		else if(CalculateImageChecksum(Outfd,ImageHeaderStart,
+						(i == nsecs) ? &UsedMap : NULL) == 0)
+			printf("ERROR: Image Checksum calculation failed\n");
+	}
+
+	/* What has to be reprogrammed to go from the previous release */
+	if ((CmdRefFile[0] != 0) && (i == nsecs) && (!CmdDryRun))
+		printf("Erase blocks differing from %s: %lu of %lu\n",CmdRefFile,
+				ChangedBlocks(Outfd,FlashSize,BlockSize),FlashSize/BlockSize);
+
+	/* Flush and release the mapped image */
+	if (gImageMap != NULL)
+	{
+		if (msync(gImageMap,gImageSize,MS_SYNC) != 0)
+		{
+			printf("ERROR: Unable to sync the mapped Output file\n");
+			i = -1;		/* Mark the image as failed */
+		}
+		munmap(gImageMap,gImageSize);
+		gImageMap = NULL;
+	}
+
+	/* Close the Output File */
+	if (Outfd != NULL)
+		fclose(Outfd);
+	free(gOldSections);
+	gOldSections = NULL;
+	gnOldSections = 0;
+	gUpdating = 0;
+	free(gRefSections);
+	gRefSections = NULL;
+	gnRefSections = 0;
+	free(gRefBlockCRC);
+	gRefBlockCRC = NULL;
+	gnRefBlocks = 0;
+
+	/* Keep the module checksums for the next build. A dry run reads
+	 * the cache but leaves the output side untouched */
+	if ((CRCCacheFile[0] != 0) && (!CmdDryRun))
+	{
+		if (SaveCRCCache(CRCCacheFile) != 0)
+			printf("WARNING: Unable to save checksum cache %s\n",CRCCacheFile);
+	}
+	
+	/* Free the Dictionary */
+	iniparser_freedict(d);
+	FreeLayoutPlan(&Plan);
+
+	/* Display the allocated and free regions of Flash */
+	if (i == nsecs)
+	{
+		printf("Flash Image %s Successfully!\n",CmdDryRun ? "planned" : "created"); 
+		DisplayFlashMap(&UsedMap,FlashSize);	
+	}
+
+	/* What the image would hold */
+	if (CmdDryRun)
+		ShowLayoutManifest(&UsedMap,FlashSize,BlockSize,UseFMH,
+						HaveImageCRC,ImageCRC,i == nsecs);
+
+	FreeSectionMap(&UsedMap);
+	return (i == nsecs) ? 0 : 1;
+}
+
+/* Create the FMH (and Alternate FMH) of a section whose module is 
+ * in place, write them and record the section content */
+int
+FinishSection(FILE *Outfd,SECTION *Section,char *SecName,MODULE_INFO *mod,
+			UINT32 Location,UINT32 AllocSize,UINT32 FMHLoc,int UseFMH,UINT32 BlockSize)
+{
+	FMH fmh;				/* Flash Module Header */	
+	ALT_FMH altfmh,*paltfmh;	/* Alternate Flash Module Header */
+
+	CreateFMH(&fmh,AllocSize,mod,Location+FMHLoc);
+	if ((mod->Module_Type == MODULE_FMH_FIRMWARE) ||
+	    (mod->Module_Type == MODULE_FIRMWARE_1_4))
+		fmh.FMH_Header_Checksum = 0x00;
+	paltfmh = NULL;
+	if (FMHLoc != 0)
+	{
+		printf("%s: Alternate location @ 0x%lx\n",SecName,FMHLoc);
+		CreateAlternateFMH(&altfmh,FMHLoc);
+		paltfmh = &altfmh;
+	}
+
+// Write FMH/ALTFMH after Module is written 
+	/* Write the FMH to output file */
+	if (UseFMH && !Section->Kept && !CmdDryRun)
+	{
+		if (WriteFMHtoFile(Outfd,&fmh,paltfmh,Location,BlockSize) != 0)
+		{
+			printf("ERROR: Unable to Write FMH of Section %s\n",SecName);
+			return 1;
+		}
+	}
+
+	/* Remember what went into the section for the image checksum */
+	Section->HasFMH = UseFMH;
+	Section->FMHOffset = FMHLoc;
+	memcpy(&Section->Fmh,&fmh,sizeof(FMH));
+	if ((UseFMH) && (paltfmh != NULL))
+	{
+		Section->HasAltFMH = 1;
+		memcpy(&Section->AltFmh,paltfmh,sizeof(ALT_FMH));
+	}
+	Section->ModOffset = mod->Module_Location;
+	Section->ModSize = mod->Module_Size;
+	if ((mod->Module_Type != MODULE_FMH_FIRMWARE) &&
+	    (mod->Module_Type != MODULE_FIRMWARE_1_4))
+		Section->ModCRC = mod->Module_Checksum;
+	else
+		Section->ModCRC = CalculateCRC32(FirmwareInfo,mod->Module_Size);
+	Section->Written = 1;
+	return 0;
+}
+
+/* Modification time of a file in nano seconds */
+static
+long long
+FileMtimeNs(struct stat *Stat)
+{
+	return ((long long)Stat->st_mtim.tv_sec * 1000000000LL) + Stat->st_mtim.tv_nsec;
+}
+
+/* Find (or add) the checksum cache entry of a module. The entry is
+ * valid only if the file identity did not change since it was cached */
+static
+CRC_CACHE_ENTRY *
+LookupCRCCache(char *Path,struct stat *Stat)
+{
+	CRC_CACHE_ENTRY *Entry,**New;
+	int e;
+
+	for (e=0;e<gCRCCacheCount;e++)
+	{
+		if (strcmp(gCRCCache[e]->Path,Path) == 0)
+			break;
+	}
+
+	if (e == gCRCCacheCount)
+	{
+		if (gCRCCacheCount == gCRCCacheAlloc)
+		{
+			New = (CRC_CACHE_ENTRY **)realloc(gCRCCache,
+					(gCRCCacheAlloc+32) * sizeof(CRC_CACHE_ENTRY *));
+			if (New == NULL)
+				return NULL;
+			gCRCCache = New;
+			gCRCCacheAlloc += 32;
+		}
+		Entry = (CRC_CACHE_ENTRY *)calloc(1,sizeof(CRC_CACHE_ENTRY));
+		if (Entry == NULL)
+			return NULL;
+		Entry->Path = strdup(Path);
+		if (Entry->Path == NULL)
+		{
+			free(Entry);
+			return NULL;
+		}
+		gCRCCache[gCRCCacheCount++] = Entry;
+	}
+	else
+		Entry = gCRCCache[e];
+
+	if ((Entry->Dev != (unsigned long long)Stat->st_dev) ||
+	    (Entry->Ino != (unsigned long long)Stat->st_ino) ||
+	    (Entry->Size != (unsigned long long)Stat->st_size) ||
+	    (Entry->MtimeNs != FileMtimeNs(Stat)))
+	{
+		Entry->Dev = Stat->st_dev;
+		Entry->Ino = Stat->st_ino;
+		Entry->Size = Stat->st_size;
+		Entry->MtimeNs = FileMtimeNs(Stat);
+		Entry->Valid = 0;
+	}
+	Entry->Used = 1;
+	return Entry;
+}
+
+/* Load the checksum cache. A missing or unreadable cache is empty */
+int
+LoadCRCCache(char *CacheFile)
+{
+	FILE *fd;
+	char Line[512];
+	struct stat Stat;
+	unsigned long long Dev,Ino,Size;
+	long long MtimeNs;
+	unsigned long CRC;
+	int Len,PathStart;
+	CRC_CACHE_ENTRY *Entry;
+
+	fd = fopen(CacheFile,"r");
+	if (fd == NULL)
+		return 1;
+
+	if ((fgets(Line,sizeof(Line),fd) == NULL) ||
+	    (strncmp(Line,CRC_CACHE_MAGIC,strlen(CRC_CACHE_MAGIC)) != 0))
+	{
+		fclose(fd);
+		return 1;
+	}
+
+	while (fgets(Line,sizeof(Line),fd) != NULL)
+	{
+		/* Skip truncated lines */
+		Len = strlen(Line);
+		if ((Len == 0) || (Line[Len-1] != '\n'))
+			continue;
+		Line[Len-1] = 0;
+
+		if (sscanf(Line,"%lx %llu %llu %llu %lld %n",
+				&CRC,&Dev,&Ino,&Size,&MtimeNs,&PathStart) != 5)
+			continue;
+
+		memset(&Stat,0,sizeof(Stat));
+		Stat.st_dev = Dev;
+		Stat.st_ino = Ino;
+		Stat.st_size = Size;
+		Stat.st_mtim.tv_sec = MtimeNs / 1000000000LL;
+		Stat.st_mtim.tv_nsec = MtimeNs % 1000000000LL;
+		Entry = LookupCRCCache(&Line[PathStart],&Stat);
+		if (Entry == NULL)
+			break;
+		Entry->CRC = CRC;
+		Entry->Valid = 1;
+		Entry->Used = 0;
+	}
+	fclose(fd);
+	return 0;
+}
+
+/* Write the valid entries of the modules used in this build. The cache
+ * is replaced with a rename, so parallel builds never see a partial one */
+int
+SaveCRCCache(char *CacheFile)
+{
+	FILE *fd;
+	CRC_CACHE_ENTRY *Entry;
+	char TmpFile[sizeof(CRCCacheFile)+16];
+	int e;
+
+	sprintf(TmpFile,"%s.%d",CacheFile,(int)getpid());
+	fd = fopen(TmpFile,"w");
+	if (fd == NULL)
+		return 1;
+
+	fprintf(fd,"%s\n",CRC_CACHE_MAGIC);
+	for (e=0;e<gCRCCacheCount;e++)
+	{
+		Entry = gCRCCache[e];
+		if ((!Entry->Valid) || (!Entry->Used))
+			continue;
+		fprintf(fd,"%08lx %llu %llu %llu %lld %s\n",(unsigned long)Entry->CRC,
+				Entry->Dev,Entry->Ino,Entry->Size,Entry->MtimeNs,Entry->Path);
+	}
+
+	if (fclose(fd) != 0)
+	{
+		unlink(TmpFile);
+		return 1;
+	}
+	if (rename(TmpFile,CacheFile) != 0)
+	{
+		unlink(TmpFile);
+		return 1;
+	}
+	return 0;
+}
+
+UINT32 
+FillModuleInfo(MODULE_INFO *mod,char *InFile,CRC_CACHE_ENTRY **Cached)
+{
+	struct stat InStat;
+
+	/* Get the Module File Size */
+	if (stat(InFile,&InStat) != 0)
+			return 0;	/* Error in stat. Possibly a bad file */
+
+	/* Checksum of the module from the previous build, if any */
+	if ((CRCCacheFile[0] != 0) && (Cached != NULL))
+		*Cached = LookupCRCCache(InFile,&InStat);
+	
+	/* Return Module Size */
+	return InStat.st_size;			
+}
+
+/* Write Size bytes at Offset of the output image */
+static
+int
+WriteImage(FILE *fd,UINT32 Offset,void *Data,UINT32 Size)
+{
+	if (gImageMap != NULL)
+	{
+		if (Offset+Size > gImageSize)
+			return 1;
+		memcpy(gImageMap+Offset,Data,Size);
+		return 0;
+	}
+
+	if (fseek(fd,Offset,SEEK_SET) != 0)
+		return 1;
+	if (fwrite(Data,Size,1,fd) != 1)
+		return 1;
+	return 0;
+}
+
+/* Read Size bytes at Offset of the output image */
+static
+int
+ReadImage(FILE *fd,UINT32 Offset,void *Data,UINT32 Size)
+{
+	if (gImageMap != NULL)
+	{
+		if (Offset+Size > gImageSize)
+			return 1;
+		memcpy(Data,gImageMap+Offset,Size);
+		return 0;
+	}
+
+	if (fseek(fd,Offset,SEEK_SET) != 0)
+		return 1;
+	if (fread(Data,Size,1,fd) != 1)
+		return 1;
+	return 0;
+}
+
+int 
+WriteFMHtoFile(FILE *fd,FMH *fmh,ALT_FMH *altfmh,UINT32 Start,
+														UINT32 BlockSize)
+{
+	UINT32 offset = 0;
+
+	if (altfmh != NULL)
+		offset = altfmh->FMH_Link_Address;
+
+	/* Write FMH Header */
+	if (WriteImage(fd,Start+offset,(void *)fmh,sizeof(FMH)) != 0)
+	{
+		printf("ERROR:Unable to write FMH Header at %ld\n",Start+offset);
+		return 1;
+	}
+			
+	/* Write Alternate FMH Header */
+	if (altfmh != NULL)
+	{
+		offset = BlockSize - sizeof(ALT_FMH);
+		if (WriteImage(fd,Start+offset,(void *)altfmh,sizeof(ALT_FMH)) != 0)
+		{
+			printf("ERROR:Unable to write ALTFMH Header at %ld\n",Start+offset);
+			return 1;
+		}
+	}
 
-#if 0			
-			/* For JFFS and JFFS2, it should be a multiple of BlockSize */
-			/* Otherwise the mtd will be mounted read only */
-			if ((mod.Module_Type == MODULE_JFFS) || 
-							(mod.Module_Type == MODULE_JFFS2))
-			{		
-				InFileSize = (InFileSize+BlockSize-1);
-				InFileSize = (InFileSize/BlockSize) * BlockSize;
-			}
+	return 0;
+}
+
+/* crc32 of a module through a read-only mapping, without copying it */
+static
+int
+MapModuleCRC(int Infd,UINT32 Size,UINT32 *crc32)
+{
+	unsigned char *Data;
+
+	Data = mmap(NULL,Size,PROT_READ,MAP_SHARED,Infd,0);
+	if (Data == MAP_FAILED)
+		return 1;
+	madvise(Data,Size,MADV_SEQUENTIAL);
+
+	*crc32 = CalculateCRC32(Data,Size);
+	munmap(Data,Size);
+	return 0;
+}
+
+/* Place a module in the output without moving its data through user 
+ * space: share the blocks (FICLONERANGE) when the filesystem and the 
+ * offsets allow it, and let the kernel copy (copy_file_range) the rest.
+ * Returns non zero if the caller has to copy the module itself */
+static
+int
+ZeroCopyModule(FILE *Outfd,int Infd,UINT32 Location,MODULE_INFO *mod,
+												CRC_CACHE_ENTRY *Cached)
+{
+	struct stat OutStat;
+	loff_t InOff,OutOff;
+	UINT32 Done = 0,crc32;
+	ssize_t Len;
+#ifdef FICLONERANGE
+	struct file_clone_range Clone;
 #endif
-			
-			mod.Module_Size = InFileSize;
-			
-			/* Calculate the Min Allocation Size */
-			MinAllocSize = mod.Module_Location + InFileSize;			
-			MinAllocSize += (BlockSize-1);
-			MinAllocSize = (MinAllocSize/BlockSize) * BlockSize;
 
-			if (AllocSize != 0)
-			{
-				if (AllocSize < MinAllocSize)
-					printf("WARNING: Section %s size exceeds the Allocated Size\n",SecName);
-			}
+	if (mod->Module_Size == 0)
+		return 1;
 
-			if (AllocSize < MinAllocSize)
-				AllocSize = MinAllocSize;
-			
+	/* Checksum first: a module that cannot be mapped is copied instead */
+	if ((Cached != NULL) && (Cached->Valid))
+		crc32 = Cached->CRC;
+	else if (MapModuleCRC(Infd,mod->Module_Size,&crc32) != 0)
+		return 1;
+
+	/* Data still buffered by stdio has to reach the file first */
+	if (fflush(Outfd) != 0)
+		return 1;
+	if (fstat(fileno(Outfd),&OutStat) != 0)
+		return 1;
+
+#ifdef FICLONERANGE
+	/* Only whole filesystem blocks can be shared */
+	if ((OutStat.st_blksize > 0) && ((Location % OutStat.st_blksize) == 0))
+	{
+		Clone.src_fd = Infd;
+		Clone.src_offset = 0;
+		Clone.src_length = mod->Module_Size - (mod->Module_Size % OutStat.st_blksize);
+		Clone.dest_offset = Location;
+		if ((Clone.src_length != 0) &&
+		    (ioctl(fileno(Outfd),FICLONERANGE,&Clone) == 0))
+			Done = Clone.src_length;
+	}
+#endif
+
+	while (Done < mod->Module_Size)
+	{
+		InOff = Done;
+		OutOff = Location + Done;
+		Len = copy_file_range(Infd,&InOff,fileno(Outfd),&OutOff,
+						mod->Module_Size - Done,0);
+		if (Len <= 0)
+			return 1;	/* Not supported here, or the module shrank */
+		Done += Len;
+	}
+
+	/* Fill Module Checksum */
+	mod->Module_Checksum = crc32;
+	return 0;
+}
+
+/* Remember the checksum of a copied module */
+static
+void
+UpdateCRCCache(CRC_CACHE_ENTRY *Cached,UINT32 crc32)
+{
+	if (Cached == NULL)
+		return;
+	Cached->CRC = crc32;
+	Cached->Valid = 1;
+}
+
+/* Read the FMH of the section starting at Start of the output image,
+ * looking only at the bytes ScanforFMH needs. Returns the FMH offset
+ * from Start, or INVALID_FMH_OFFSET if there is none */
+static
+UINT32
+ReadImageFMH(FILE *fd,UINT32 Start,unsigned char *Block,UINT32 BlockSize,
+											FMH *fmh,ALT_FMH *altfmh)
+{
+	ALT_FMH *Alt = (ALT_FMH *)(Block+BlockSize-sizeof(ALT_FMH));
+	UINT32 Offset = INVALID_FMH_OFFSET;
+	FMH *Found;
+
+	memset(Block,0,sizeof(FMH));
+	memset(Alt,0,sizeof(ALT_FMH));
+	if ((ReadImage(fd,Start,Block,sizeof(FMH)) != 0) ||
+	    (ReadImage(fd,Start+BlockSize-sizeof(ALT_FMH),Alt,sizeof(ALT_FMH)) != 0))
+		return INVALID_FMH_OFFSET;
+
+	/* Bring in the FMH the alternate FMH points to */
+	if (strncmp((char *)Block,FMH_SIGNATURE,sizeof(FMH_SIGNATURE)-1) != 0)
+	{
+		if (strncmp((char *)Alt->FMH_Signature,FMH_SIGNATURE,sizeof(FMH_SIGNATURE)-1) != 0)
+			return INVALID_FMH_OFFSET;
+		Offset = le32_to_host(Alt->FMH_Link_Address);
+		if ((Offset < sizeof(FMH)) || (Offset > BlockSize-sizeof(ALT_FMH)-sizeof(FMH)))
+			return INVALID_FMH_OFFSET;
+		if (ReadImage(fd,Start+Offset,Block+Offset,sizeof(FMH)) != 0)
+			return INVALID_FMH_OFFSET;
+	}
+
+	Found = ScanforFMH(Block,BlockSize);
+	if (Found == NULL)
+	{
+		if (Offset != INVALID_FMH_OFFSET)
+			memset(Block+Offset,0,sizeof(FMH));
+		return INVALID_FMH_OFFSET;
+	}
+	memcpy(fmh,Found,sizeof(FMH));
+	memcpy(altfmh,Alt,sizeof(ALT_FMH));
+
+	/* Found may be the linked FMH: copy it out before the block is cleared
+	 * for the next call */
+	if (Offset != INVALID_FMH_OFFSET)
+		memset(Block+Offset,0,sizeof(FMH));
+	return (unsigned char *)Found - Block;
+}
+
+/* Build the FMH table of an image (the one being updated or the reference),
+ * reading only the headers. Returns the number of sections found */
+int
+ScanOldImage(FILE *fd,UINT32 FlashSize,UINT32 BlockSize,OLD_SECTION **pSections)
+{
+	unsigned char *Block;
+	OLD_SECTION *Old,*New;
+	int nSections = 0;
+	FMH fmh;
+	ALT_FMH altfmh;
+	UINT32 Start,Offset,Alloc;
+	int Alloced = 0;
+
+	Block = (unsigned char *)calloc(1,BlockSize);
+	if (Block == NULL)
+		return 0;
+
+	for (Start = 0; Start+BlockSize <= FlashSize; Start += Alloc)
+	{
+		Alloc = BlockSize;
+		Offset = ReadImageFMH(fd,Start,Block,BlockSize,&fmh,&altfmh);
+		if (Offset == INVALID_FMH_OFFSET)
+			continue;
+
+		if (nSections == Alloced)
+		{
+			New = (OLD_SECTION *)realloc(*pSections,(Alloced+32)*sizeof(OLD_SECTION));
+			if (New == NULL)
+				break;
+			*pSections = New;
+			Alloced += 32;
 		}
-		else
+		Old = &(*pSections)[nSections++];
+		memset(Old,0,sizeof(OLD_SECTION));
+		Old->Loc = Start;
+		Old->FMHOffset = Offset;
+		memcpy(&Old->Fmh,&fmh,sizeof(FMH));
+		if (Offset != 0)
 		{
-			/* Check if Firmware version is overridden by Build script */
-			VersionStr = getenv("FW_MAJOR");
-			if (VersionStr != NULL)
-			{
-				if (sscanf(VersionStr,"%d",&FirmwareMajor) == 1)
-					mod.Module_Ver_Major = (unsigned char)FirmwareMajor;
-			}
+			Old->HasAltFMH = 1;
+			memcpy(&Old->AltFmh,&altfmh,sizeof(ALT_FMH));
+		}
 
-			VersionStr = getenv("FW_MINOR");
-			if (VersionStr != NULL)
+		/* Skip the rest of the section */
+		Alloc = le32_to_host(fmh.FMH_AllocatedSize);
+		Alloc = ((Alloc + BlockSize - 1) / BlockSize) * BlockSize;
+		if ((Alloc == 0) || (Alloc > FlashSize - Start))
+			Alloc = BlockSize;
+	}
+	free(Block);
+	return nSections;
+}
+
+/* Scan the previous release used as the layout reference and keep the
+ * crc32 of each of its erase blocks. It must be read before the output
+ * is mapped, since ReadImage() then reads the mapping */
+int
+LoadReferenceImage(char *RefFile,UINT32 FlashSize,UINT32 BlockSize)
+{
+	FILE *fd;
+	struct stat Stat;
+	unsigned char *Block;
+	UINT32 RefSize,b;
+
+	fd = fopen(RefFile,"rb");
+	if ((fd == NULL) || (fstat(fileno(fd),&Stat) != 0))
+	{
+		printf("ERROR: Unable to open reference image %s\n",RefFile);
+		if (fd != NULL)
+			fclose(fd);
+		return 1;
+	}
+	RefSize = (Stat.st_size < FlashSize) ? Stat.st_size : FlashSize;
+	RefSize = (RefSize / BlockSize) * BlockSize;
+
+	gnRefSections = ScanOldImage(fd,RefSize,BlockSize,&gRefSections);
+	if (gnRefSections == 0)
+		printf("WARNING: No sections found in reference image %s\n",RefFile);
+
+	gnRefBlocks = RefSize / BlockSize;
+	gRefBlockCRC = (UINT32 *)calloc(gnRefBlocks+1,sizeof(UINT32));
+	Block = (unsigned char *)malloc(BlockSize);
+	if ((gRefBlockCRC == NULL) || (Block == NULL) || (fseek(fd,0,SEEK_SET) != 0))
+	{
+		printf("ERROR: Unable to read reference image %s\n",RefFile);
+		free(Block);
+		fclose(fd);
+		return 1;
+	}
+	for (b=0;b<gnRefBlocks;b++)
+	{
+		if (fread(Block,BlockSize,1,fd) != 1)
+			break;
+		gRefBlockCRC[b] = CalculateCRC32(Block,BlockSize);
+	}
+	gnRefBlocks = b;
+	free(Block);
+	fclose(fd);
+	return 0;
+}
+
+/* Keep each Locate = AUTO section where the reference has a section of
+ * the same name. The sections that still fit in their old range keep it
+ * (and their old Alloc) first, then the grown ones are grown in place if
+ * the flash after them is free. What cannot be kept is left to 
+ * PlaceAutoSections() */
+void
+PlaceFromReference(SECTION_MAP *Map,MODULE_JOB *Layout,int nLayout,
+												UINT32 FlashSize)
+{
+	MODULE_JOB *Job;
+	OLD_SECTION *Ref;
+	UINT32 Alloc;
+	int Grow,k,r;
+
+	for (Grow=0;Grow<2;Grow++)
+	for (k=0;k<nLayout;k++)
+	{
+		Job = &Layout[k];
+		if (Job->Section != NULL)
+			continue;
+
+		Ref = NULL;
+		for (r=0;r<gnRefSections;r++)
+		{
+			if ((!gRefSections[r].Kept) && 
+			    (memcmp(gRefSections[r].Fmh.Module_Info.Module_Name,
+						Job->Mod.Module_Name,8) == 0))
 			{
-				if (sscanf(VersionStr,"%d",&FirmwareMinor) == 1)
-					mod.Module_Ver_Minor = (unsigned char)FirmwareMinor;
+				Ref = &gRefSections[r];
+				break;
 			}
-			
-			/* For Ractrends Series Firmware Section has some vendor specific Info */
-			BuildFile = Convert2FullPath(OutDir,"BUILDNO");
-			mod.Module_Size = CreateFirmwareInfo(&FirmwareInfo[0],BuildFile,
-										mod.Module_Ver_Major,mod.Module_Ver_Minor,d);
-										
-			if (mod.Module_Size > ((64*1024) - 0x40))
-				mod.Module_Size = 0;
 		}
-	
-		/* Read Flash Location .It can be either START or END or numeric value */
-		Location = 0xFFFFFFFF;
-		sprintf(Key,"%s:Locate",SecName);
-		LocationStr = iniparser_getstr(d,Key);
-		if (LocationStr == NULL)
+		if (Ref == NULL)
+			continue;
+
+		Alloc = le32_to_host(Ref->Fmh.FMH_AllocatedSize);
+		if (Job->AllocSize > Alloc)
+		{
+			if (!Grow)
+				continue;
+			Alloc = Job->AllocSize;
+		}
+		if ((Alloc > FlashSize) || (Ref->Loc > FlashSize - Alloc) ||
+		    (FindOverlap(Map->Root,Ref->Loc,Ref->Loc+Alloc) != NULL))
+			continue;
+		if (AddSection(Map,Ref->Loc,Alloc,Job->SecName,Job->Mod.Module_Ver_Major,
+							Job->Mod.Module_Ver_Minor,&Job->Section) != 0)
+		{
+			Job->Section = NULL;
+			continue;
+		}
+		Ref->Kept = 1;
+		Job->Location = Ref->Loc;
+		Job->AllocSize = Alloc;
+		printf("%s: Kept @ 0x%lx as in the reference\n",Job->SecName,Job->Location);
+	}
+}
+
+/* Count the erase blocks of the image that differ from the reference */
+unsigned long
+ChangedBlocks(FILE *fd,UINT32 FlashSize,UINT32 BlockSize)
+{
+	unsigned char *Block;
+	unsigned long Changed = 0;
+	UINT32 b;
+
+	Block = (unsigned char *)malloc(BlockSize);
+	for (b=0;b<FlashSize/BlockSize;b++)
+	{
+		if ((b >= gnRefBlocks) || (Block == NULL) ||
+		    (ReadImage(fd,b*BlockSize,Block,BlockSize) != 0) ||
+		    (CalculateCRC32(Block,BlockSize) != gRefBlockCRC[b]))
+			Changed++;
+	}
+	free(Block);
+	return Changed;
+}
+
+/* crc32 of a module file */
+static
+int
+ModuleFileCRC(char *InFile,UINT32 Size,UINT32 *crc32)
+{
+	int Infd;
+	UINT32 Done;
+	ssize_t Len;
+
+	Infd = open(InFile,O_RDONLY);
+	if (Infd < 0)
+		return 1;
+	if (MapModuleCRC(Infd,Size,crc32) == 0)
+	{
+		close(Infd);
+		return 0;
+	}
+
+	BeginCRC32(crc32);
+	for (Done = 0; Done < Size; Done += Len)
+	{
+		Len = read(Infd,IOBuffer,IO_CHUNK_SIZE);
+		if (Len <= 0)
+			break;
+		if (Len > Size - Done)
+			Len = Size - Done;
+		UpdateCRC32(crc32,IOBuffer,Len);
+	}
+	EndCRC32(crc32);
+	close(Infd);
+	return (Done == Size) ? 0 : 1;
+}
+
+/* Checksum of a module: the cached one, or one pass over the file */
+int
+CachedModuleCRC(char *InFile,UINT32 Size,CRC_CACHE_ENTRY *Cached,UINT32 *crc32)
+{
+	if ((Cached != NULL) && (Cached->Valid))
+	{
+		*crc32 = Cached->CRC;
+		return 0;
+	}
+	if (ModuleFileCRC(InFile,Size,crc32) != 0)
+		return 1;
+	UpdateCRCCache(Cached,*crc32);
+	return 0;
+}
+
+/* Check whether the image being updated already holds this section 
+ * with the same headers and module, so that it does not have to be 
+ * written again. On success the module checksum is filled and the
+ * section is marked as kept */
+int
+KeepOldSection(SECTION *Section,MODULE_INFO *mod,char *InFile,
+			UINT32 Location,UINT32 AllocSize,UINT32 FMHLoc,CRC_CACHE_ENTRY *Cached)
+{
+	OLD_SECTION *Old = NULL;
+	FMH fmh;
+	ALT_FMH altfmh;
+	UINT32 crc32;
+	int o;
+
+	for (o=0;o<gnOldSections;o++)
+	{
+		if (gOldSections[o].Loc == Location)
+		{
+			Old = &gOldSections[o];
+			break;
+		}
+	}
+	if ((Old == NULL) || (Old->FMHOffset != FMHLoc))
+		return 1;
+
+	/* Same module size is cheap to check before the checksum */
+	if (Old->Fmh.Module_Info.Module_Size != mod->Module_Size)
+		return 1;
+
+	/* Module identity */
+	if (CachedModuleCRC(InFile,mod->Module_Size,Cached,&crc32) != 0)
+		return 1;
+	mod->Module_Checksum = crc32;
+
+	CreateFMH(&fmh,AllocSize,mod,Location+FMHLoc);
+	if (memcmp(&fmh,&Old->Fmh,sizeof(FMH)) != 0)
+		return 1;
+	if (FMHLoc != 0)
+	{
+		CreateAlternateFMH(&altfmh,FMHLoc);
+		if (memcmp(&altfmh,&Old->AltFmh,sizeof(ALT_FMH)) != 0)
+			return 1;
+	}
+
+	Old->Kept = 1;
+	Section->Kept = 1;
+	return 0;
+}
+
+/* Copy a module to Location of the output and fill its checksum.
+ * Only positioned writes are used, so several modules can be copied
+ * at once as long as each caller has its own Buffer */
+static
+int
+CopyModule(FILE *Outfd,char *InFile,UINT32 Location,MODULE_INFO *mod,
+						CRC_CACHE_ENTRY *Cached,unsigned char *Buffer)
+{
+	int Infd;
+	UINT32 Done,crc32;
+	ssize_t Len;
+	struct stat InStat;
+
+	/* Open Module File */
+	Infd = open(InFile,O_RDONLY);
+	if (Infd < 0)
+		return 1;
+
+	/* The cached checksum is only good for the file that was looked up */
+	if (Cached != NULL)
+	{
+		if ((fstat(Infd,&InStat) != 0) ||
+		    (Cached->Dev != (unsigned long long)InStat.st_dev) ||
+		    (Cached->Ino != (unsigned long long)InStat.st_ino) ||
+		    (Cached->Size != (unsigned long long)InStat.st_size) ||
+		    (Cached->MtimeNs != FileMtimeNs(&InStat)))
+			Cached->Valid = 0;
+	}
+
+	/* Read the module straight into the mapped image */
+	if (gImageMap != NULL)
+	{
+		if (Location+mod->Module_Size > gImageSize)
 		{
-			printf("ERROR: Unable to get Module Location in Flash for %s\n",SecName);
-			break;
+			close(Infd);
+			return 1;
 		}
-		if (strcasecmp(LocationStr,"START") == 0)
-				Location = 0;
-		if (strcasecmp(LocationStr,"END") == 0)
-				Location = FlashSize-AllocSize;
-		if (Location == 0xFFFFFFFF)		
+		BeginCRC32(&crc32);
+		for (Done = 0; Done < mod->Module_Size; Done += Len)
 		{
-			Location = iniparser_getlong(d,Key,0xFFFFFFFF);
-			if (Location == 0xFFFFFFFF)
-			{
-				printf("ERROR: Unable to get Module Location in Flash for %s\n",SecName);
+			Len = mod->Module_Size - Done;
+			if (Len > IO_CHUNK_SIZE)
+				Len = IO_CHUNK_SIZE;
+			Len = read(Infd,gImageMap+Location+Done,Len);
+			if (Len <= 0)
 				break;
-			}
+			UpdateCRC32(&crc32,gImageMap+Location+Done,Len);
 		}
+		EndCRC32(&crc32);
+		close(Infd);
+		if (Done != mod->Module_Size)
+			return 1;
+		mod->Module_Checksum = crc32;
+		UpdateCRCCache(Cached,crc32);
+		return 0;
+	}
 
-		/* Validate Location */
-		if ((Location > FlashSize) || (Location+AllocSize > FlashSize))
-		{
-			printf("ERROR: Module Location %ld, Alloc %ld,  > Flash %ld for %s\n",
-							Location,AllocSize,FlashSize,SecName);
-			break;
-		}
+	/* Let the kernel place the module if it can */
+	if (ZeroCopyModule(Outfd,Infd,Location,mod,Cached) == 0)
+	{
+		close(Infd);
+		UpdateCRCCache(Cached,mod->Module_Checksum);
+		return 0;
+	}
+	posix_fadvise(Infd,0,0,POSIX_FADV_SEQUENTIAL);
 
-		/* Check for overlapping sections and add location and size 
-		 * and section name to the chain of used areas */
-		if (AddToUsedChain(&UsedChain,Location,AllocSize,SecName,
-						mod.Module_Ver_Major,mod.Module_Ver_Minor) != 0)
-				break;
+	/* Data still buffered by stdio has to reach the file first */
+	if (fflush(Outfd) != 0)
+	{
+		close(Infd);
+		return 1;
+	}
 
-		/* Create FMH and Alternate FMH if required */
-		CreateFMH(&fmh,AllocSize,&mod,Location+FMHLoc);
-		if ((mod.Module_Type == MODULE_FMH_FIRMWARE) ||
-		    (mod.Module_Type == MODULE_FIRMWARE_1_4))
-		{
-			fmh.FMH_Header_Checksum = 0x00;
-			ImageHeaderStart = Location;			
-		}
-		paltfmh = NULL;
-		if (FMHLoc != 0)
+	/* Read the module once, calculating crc32 while writing it out */
+	BeginCRC32(&crc32);
+	for (Done = 0; Done < mod->Module_Size; Done += Len)
+	{
+		Len = read(Infd,Buffer,IO_CHUNK_SIZE);
+		if (Len <= 0)
+			break;
+		if (Len > mod->Module_Size - Done)
+			Len = mod->Module_Size - Done;
+		UpdateCRC32(&crc32,Buffer,Len);
+		if (pwrite(fileno(Outfd),Buffer,Len,Location+Done) != Len)
 		{
-			printf("%s: Alternate location @ 0x%lx\n",SecName,FMHLoc);
-			CreateAlternateFMH(&altfmh,FMHLoc);
-			paltfmh = &altfmh;
+//			printf("ERROR:Unable to write Module \n");
+			close(Infd);
+			return 1;
 		}
+	}
+	EndCRC32(&crc32);
+	close(Infd);
 
+	/* Module changed size since it was checked */
+	if (Done != mod->Module_Size)
+		return 1;
 
-		if ((mod.Module_Type != MODULE_FMH_FIRMWARE) &&
-		    (mod.Module_Type != MODULE_FIRMWARE_1_4))
-		{
-			if (WriteModuletoFile(Outfd,InFile,Location+mod.Module_Location)!= 0)
-			{
-				printf("ERROR: Unable to Write Module of Section %s\n",SecName);
-				break;
-			}
-		}
-		else
+	/* Fill Module Checksum */
+	mod->Module_Checksum = crc32;
+	UpdateCRCCache(Cached,crc32);
+	return 0;
+}
+
+int
+WriteModuletoFile(FILE *Outfd,char *InFile, UINT32 Location,MODULE_INFO *mod,
+												CRC_CACHE_ENTRY *Cached)
+{
+	return CopyModule(Outfd,InFile,Location,mod,Cached,IOBuffer);
+}
+
+/* Worker pool state for RunModuleJobs */
+static MODULE_JOB *gJobs;
+static int gnJobs;
+static int gNextJob;
+static FILE *gJobOutfd;
+
+static
+void *
+ModuleWorker(void *Arg)
+{
+	unsigned char *Buffer;
+	MODULE_JOB *Job;
+	int j;
+
+	Buffer = (unsigned char *)memalign(4096,IO_CHUNK_SIZE);
+	while ((j = __sync_fetch_and_add(&gNextJob,1)) < gnJobs)
+	{
+		Job = &gJobs[j];
+		if (Buffer == NULL)
 		{
-			if (mod.Module_Size > 0)
-			{
-				if (WriteFirmwareInfo(Outfd,(char *)FirmwareInfo,mod.Module_Size,
-												Location+mod.Module_Location)!= 0)
-				{
-					printf("ERROR: Unable to Write Firmware Info in Section %s\n",SecName);						 break;
-				}	
-			}
-			else
-				printf("INFO: No Firmware Information written to FIRMWARE Section\n");	
+			Job->Status = 1;
+			continue;
 		}
+		Job->Status = CopyModule(gJobOutfd,Job->InFile,
+					Job->Location+Job->Mod.Module_Location,&Job->Mod,
+					Job->Cached,Buffer);
+	}
+	free(Buffer);
+	return NULL;
+}
 
-// Write FMH/ALTFMH after Module is written 
-		/* Write the FMH to output file */
-		if (UseFMH)
+/* Copy the queued modules with nThreads workers. Each job writes only 
+ * its own (non overlapping) part of the image. The result of every
+ * copy is left in its Status */
+int
+RunModuleJobs(FILE *Outfd,MODULE_JOB *Jobs,int nJobs,int nThreads)
+{
+	pthread_t *Threads;
+	int t,Started = 0;
+
+	gJobs = Jobs;
+	gnJobs = nJobs;
+	gNextJob = 0;
+	gJobOutfd = Outfd;
+
+	/* Flush what the serial pass left buffered before the workers start */
+	fflush(Outfd);
+
+	if (nThreads > nJobs)
+		nThreads = nJobs;
+	Threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+	if (Threads != NULL)
+	{
+		for (t=0;t<nThreads;t++)
 		{
-			if (WriteFMHtoFile(Outfd,&fmh,paltfmh,Location,BlockSize) != 0)
-			{
-				printf("ERROR: Unable to Write FMH of Section %s\n",SecName);
+			if (pthread_create(&Threads[Started],NULL,ModuleWorker,NULL) != 0)
 				break;
-			}
+			Started++;
 		}
-	
 	}
-	/* Calculate complete image checksum now and fill in the MODULE INFO checksum field */
-	if (ImageHeaderStart != 0xFFFFFFFF)
+
+	/* Whatever no worker could be started for is copied here */
+	ModuleWorker(NULL);
+
+	for (t=0;t<Started;t++)
+		pthread_join(Threads[t],NULL);
+	free(Threads);
+	return 0;
+}
+
+int
+WriteFirmwareInfo(FILE *Outfd,char *Data,UINT32 Size, UINT32 Location)
+{
+	/* Write Data */	
+	if (WriteImage(Outfd,Location,(void *)Data,Size) != 0)
 	{
-		if(CalculateImageChecksum(Outfd,ImageHeaderStart) == 0)
-			printf("ERROR: Image Checksum calculation failed\n");
+//		printf("ERROR:Unable to write Module\n");
+		return 1;
 	}
+	return 0;
+}
 
-	/* Close the Output File */
-	fclose(Outfd);
-	
-	/* Free the Dictionary */
-	iniparser_freedict(d);
+/* Add the bytes [Start,End) of the output file to a running crc32 */
+static
+int
+CRCFileRange(FILE *fd,UINT32 *crc32,UINT32 Start,UINT32 End)
+{
+	UINT32 Len;
 
-	/* Display the allocated and free regions of Flash */
-	if (i == nsecs)
+	if (gImageMap != NULL)
 	{
-		printf("Flash Image created Successfully!\n"); 
-		DisplayFlashMap(UsedChain,FlashSize);	
+		if (End > gImageSize)
+			return 1;
+		UpdateCRC32(crc32,gImageMap+Start,End-Start);
 		return 0;
 	}
-	return 1;
+
+	if (fseek(fd,Start,SEEK_SET) != 0)
+		return 1;
+
+	while (Start < End)
+	{
+		Len = End - Start;
+		if (Len > IO_CHUNK_SIZE)
+			Len = IO_CHUNK_SIZE;
+		if (fread(IOBuffer,Len,1,fd) != 1)
+			return 1;
+		UpdateCRC32(crc32,IOBuffer,Len);
+		Start += Len;
+	}
+	return 0;
 }
 
-UINT32 
-FillModuleInfo(MODULE_INFO *mod,char *InFile)
+/* Part of a section whose crc32 is known without reading the image */
+#define PIECE_FMH		0
+#define PIECE_ALTFMH		1
+#define PIECE_MODULE		2
+
+typedef struct
 {
-	struct stat InStat;
-	UINT32 FileSize;
-    UINT32 i,crc32;
-	int fd;
-	unsigned char data;
+	int Type;			/* PIECE_xxx */
+	UINT32 Offset;			/* From the section start */
+	UINT32 Size;			/* Bytes covered in the image */
+	UINT32 CRCSize;			/* Bytes that go into the checksum */
+	UINT32 CRC;
+} SECTION_PIECE;
+
+/* crc32 of the FIRMWARE FMH without the fields excluded from the image checksum */
+static
+UINT32
+ImageHeaderCRC(FMH *fmh)
+{
+	unsigned char *Data = (unsigned char *)fmh;
+	UINT32 crc32;
 
+	BeginCRC32(&crc32);
+	UpdateCRC32(&crc32,Data,FMH_FMH_HEADER_CHECKSUM_OFFSET);
+	UpdateCRC32(&crc32,Data+FMH_FMH_HEADER_CHECKSUM_OFFSET+1,
+			FMH_MODULE_CHECKSUM_START_OFFSET-FMH_FMH_HEADER_CHECKSUM_OFFSET-1);
+	UpdateCRC32(&crc32,Data+FMH_MODULE_CHCKSUM_END_OFFSET+1,
+			sizeof(FMH)-FMH_MODULE_CHCKSUM_END_OFFSET-1);
+	EndCRC32(&crc32);
+	return crc32;
+}
 
-	/* Get the Module File Size */
-	if (stat(InFile,&InStat) != 0)
-			return 0;	/* Error in stat. Possibly a bad file */
-	FileSize = InStat.st_size;
+/* Fill the parts of a written section that are not erased, sorted by
+ * offset. The CRC fields are left for the caller. Returns the count */
+static
+int
+SectionPieces(SECTION *Section,SECTION_PIECE *Piece)
+{
+	SECTION_PIECE Tmp;
+	int n = 0,i,j;
 
-	/* Open the File for crc32 calculation */
-	fd = open(InFile,O_RDONLY);
-	if (fd < 0)
-		return 0;
+	if (Section->HasFMH)
+	{
+		Piece[n].Type = PIECE_FMH;
+		Piece[n].Offset = Section->FMHOffset;
+		Piece[n].Size = Piece[n].CRCSize = sizeof(FMH);
+		n++;
+	}
+	if (Section->HasAltFMH)
+	{
+		Piece[n].Type = PIECE_ALTFMH;
+		Piece[n].Offset = gBlkSize - sizeof(ALT_FMH);
+		Piece[n].Size = Piece[n].CRCSize = sizeof(ALT_FMH);
+		n++;
+	}
+	if (Section->ModSize != 0)
+	{
+		Piece[n].Type = PIECE_MODULE;
+		Piece[n].Offset = Section->ModOffset;
+		Piece[n].Size = Piece[n].CRCSize = Section->ModSize;
+		n++;
+	}
 
-	/* Read the data and calculate crc32 */	
-	BeginCRC32(&crc32);
-    for(i = 0; i < FileSize; i++)
+	/* Sort by offset */
+	for (i = 1; i < n; i++)
 	{
-		if (read(fd,&data,1) != 1)
+		for (j = i; (j > 0) && (Piece[j].Offset < Piece[j-1].Offset); j--)
 		{
-			close(fd);
-			return 0;
+			Tmp = Piece[j];
+			Piece[j] = Piece[j-1];
+			Piece[j-1] = Tmp;
 		}
-		DoCRC32(&crc32,data);
 	}
-	EndCRC32(&crc32);
-	close(fd);
-	
-	/* Fill Module Checksum */
-	mod->Module_Checksum = crc32;
-	
-	
-	/* Return Module Size */
-	return FileSize;			
+	return n;
 }
 
-int 
-WriteFMHtoFile(FILE *fd,FMH *fmh,ALT_FMH *altfmh,UINT32 Start,
-														UINT32 BlockSize)
+/* Fill [Start,End) of the output file with erased flash bytes */
+static
+int
+EraseRange(FILE *fd,UINT32 Start,UINT32 End)
 {
-	UINT32 offset = 0;
-
-	if (altfmh != NULL)
-		offset = altfmh->FMH_Link_Address;
+	static unsigned char Erased[IO_CHUNK_SIZE];
+	static int ErasedReady = 0;
+	UINT32 Len;
 
-	/* Write FMH Header */
-	if (fseek(fd,Start+offset,SEEK_SET) != 0)
+	if (gImageMap != NULL)
 	{
-		printf("ERROR:Unable to seek %ld for FMH Header\n",Start+offset);
-		return 1;
+		if (End > gImageSize)
+			return 1;
+		memset(gImageMap+Start,0xFF,End-Start);
+		return 0;
 	}
-	if (fwrite((void *)fmh,sizeof(FMH),1,fd) != 1)
+
+	if (!ErasedReady)
 	{
-		printf("ERROR:Unable to write FMH Header\n");
+		memset(Erased,0xFF,sizeof(Erased));
+		ErasedReady = 1;
+	}
+
+	if (fseek(fd,Start,SEEK_SET) != 0)
 		return 1;
+
+	while (Start < End)
+	{
+		Len = End - Start;
+		if (Len > IO_CHUNK_SIZE)
+			Len = IO_CHUNK_SIZE;
+		if (fwrite(Erased,Len,1,fd) != 1)
+			return 1;
+		Start += Len;
 	}
-			
-	/* Write Alternate FMH Header */
-	if (altfmh != NULL)
+	return 0;
+}
+
+/* Erase [Start,End) of the output. When updating an image only what 
+ * the replaced sections of the previous image wrote is erased again */
+static
+int
+EraseGap(FILE *fd,UINT32 Start,UINT32 End)
+{
+	OLD_SECTION *Old;
+	UINT32 Range[3][2];
+	UINT32 From,To;
+	int o,r;
+
+	if (!gUpdating)
+		return EraseRange(fd,Start,End);
+
+	for (o=0;o<gnOldSections;o++)
 	{
-		offset = BlockSize - sizeof(ALT_FMH);
-		if (fseek(fd,Start+offset,SEEK_SET) != 0)
+		Old = &gOldSections[o];
+		if (Old->Kept)
+			continue;
+
+		Range[0][0] = Old->Loc + Old->FMHOffset;
+		Range[0][1] = Range[0][0] + sizeof(FMH);
+		Range[1][0] = Old->Loc + Old->Fmh.Module_Info.Module_Location;
+		Range[1][1] = Range[1][0] + Old->Fmh.Module_Info.Module_Size;
+		Range[2][0] = Range[2][1] = 0;
+		if (Old->HasAltFMH)
 		{
-			printf("ERROR:Unable to seek %ld for ALTFMH Header\n",Start+offset);
-			return 1;
+			Range[2][0] = Old->Loc + gBlkSize - sizeof(ALT_FMH);
+			Range[2][1] = Range[2][0] + sizeof(ALT_FMH);
 		}
-		if (fwrite((void *)altfmh,sizeof(ALT_FMH),1,fd) != 1)
+
+		for (r=0;r<3;r++)
 		{
-			printf("ERROR:Unable to write ALTFMH Header\n");
-			return 1;
+			From = (Range[r][0] > Start) ? Range[r][0] : Start;
+			To = (Range[r][1] < End) ? Range[r][1] : End;
+			if ((From < To) && (EraseRange(fd,From,To) != 0))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Erase the gaps between sections and between the pieces of each written
+ * section. Sections that failed to be written are erased completely */
+int
+EraseUnusedFlash(FILE *fd,SECTION_MAP *Map,UINT32 FlashSize)
+{
+	SECTION_PIECE Piece[3];
+	SECTION *Section;
+	UINT32 Pos = 0,Start;
+	int n,i;
+
+	for (Section = Map->First; Section != NULL; Section = Section->Next)
+	{
+		if (!Section->Written)
+			continue;
+
+		n = SectionPieces(Section,Piece);
+		for (i = 0; i < n; i++)
+		{
+			Start = Section->Loc + Piece[i].Offset;
+			if ((Start > Pos) && (EraseGap(fd,Pos,Start) != 0))
+				return 1;
+			if (Start + Piece[i].Size > Pos)
+				Pos = Start + Piece[i].Size;
 		}
 	}
 
+	if ((Pos < FlashSize) && (EraseGap(fd,Pos,FlashSize) != 0))
+		return 1;
 	return 0;
 }
 
+/* Compute the crc32 of one section from its FMH, alternate FMH, module crc
+ * and the erased bytes around them. Returns the number of bytes covered in
+ * *pSize, or 1 if the section cannot be described this way */
+static
 int
-WriteModuletoFile(FILE *Outfd,char *InFile, UINT32 Location)
+SectionCRC(FILE *fd,SECTION *Section,int ImageHeader,UINT32 *pCRC,UINT32 *pSize)
 {
-	int Infd;
-	char data;
+	SECTION_PIECE Piece[3];
+	UINT32 crc32,Size,Pos;
+	int n,i;
 
-	/* Open Module File */
-	Infd = open(InFile,O_RDONLY);
-	if (Infd < 0)
+	/* The excluded checksum fields must fall inside the FIRMWARE FMH */
+	if (ImageHeader && ((!Section->HasFMH) || (Section->FMHOffset != 0)))
 		return 1;
 
-	/* Seek Output File */
-	if (fseek(Outfd,Location,SEEK_SET) != 0)
+	n = SectionPieces(Section,Piece);
+	for (i = 0; i < n; i++)
 	{
-		printf("ERROR:Unable to seek %ld for Module\n",Location);
-		close(Infd);
-		return 1;
+		switch (Piece[i].Type)
+		{
+			case PIECE_FMH:
+				if (ImageHeader)
+				{
+					Piece[i].CRCSize -= FMH_MODULE_CHCKSUM_END_OFFSET
+								- FMH_MODULE_CHECKSUM_START_OFFSET + 2;
+					Piece[i].CRC = ImageHeaderCRC(&Section->Fmh);
+				}
+				else
+					Piece[i].CRC = CalculateCRC32((unsigned char *)&Section->Fmh,
+										sizeof(FMH));
+				break;
+			case PIECE_ALTFMH:
+				Piece[i].CRC = CalculateCRC32((unsigned char *)&Section->AltFmh,
+										sizeof(ALT_FMH));
+				break;
+			default:
+				Piece[i].CRC = Section->ModCRC;
+				break;
+		}
 	}
 
-	while (1)
+	/* Overlapping pieces (e.g. an FMH placed inside the module data):
+	 * the image has to be read back for this section */
+	for (i = 0; i < n; i++)
 	{
-		if (read(Infd,&data,1) != 1)
-				break;
-		if (fwrite((void *)&data,1,1,Outfd) != 1)
+		if ((Piece[i].Offset+Piece[i].Size > Section->Size) ||
+		    ((i > 0) && (Piece[i].Offset < Piece[i-1].Offset+Piece[i-1].Size)))
 		{
-//			printf("ERROR:Unable to write Module \n");
-			return 1;
+			if (ImageHeader || (fd == NULL))
+				return 1;
+			BeginCRC32(&crc32);
+			if (CRCFileRange(fd,&crc32,Section->Loc,Section->Loc+Section->Size) != 0)
+				return 1;
+			EndCRC32(&crc32);
+			*pCRC = crc32;
+			*pSize = Section->Size;
+			return 0;
+		}
+	}
+
+	/* Concatenate the pieces with erased bytes in between */
+	crc32 = 0;
+	Size = 0;
+	Pos = 0;
+	for (i = 0; i <= n; i++)
+	{
+		UINT32 End = (i < n) ? Piece[i].Offset : Section->Size;
+
+		if (End > Pos)
+		{
+			crc32 = CombineCRC32(crc32,FillCRC32(0xFF,End-Pos),End-Pos);
+			Size += End-Pos;
 		}
+		if (i == n)
+			break;
+		crc32 = CombineCRC32(crc32,Piece[i].CRC,Piece[i].CRCSize);
+		Size += Piece[i].CRCSize;
+		Pos = Piece[i].Offset+Piece[i].Size;
 	}
+
+	*pCRC = crc32;
+	*pSize = Size;
 	return 0;
 }
 
+/* Assemble the image checksum from the used flash: section crc32s and
+ * closed form crc32s of the erased gaps between them */
+static
 int
-WriteFirmwareInfo(FILE *Outfd,char *Data,UINT32 Size, UINT32 Location)
+MapImageCRC(FILE *fd,SECTION_MAP *Map,unsigned long ImageHeaderStart,
+						unsigned long FileSize,UINT32 *pCRC)
 {
-	/* Seek Output File */
-	if (fseek(Outfd,Location,SEEK_SET) != 0)
-	{
-		printf("ERROR:Unable to seek %ld for Module\n",Location);
-		return 1;
-	}
+	SECTION *Section = NULL;
+	UINT32 crc32 = 0,SecCRC,SecSize;
+	UINT32 Start,End,Pos = 0;
+	int Header = 0;
 
-	/* Write Data */	
-	if (fwrite((void *)Data,Size,1,Outfd) != 1)
+	while ((Section = NextFreeGap(Map,Section,FileSize,&Start,&End)) != NULL)
 	{
-//		printf("ERROR:Unable to write Module\n");
-		return 1;
+		if (Section->Loc >= FileSize)
+			break;
+		if ((!Section->Written) || (Section->Loc+Section->Size > FileSize))
+			return 1;
+		if (End > Start)
+			crc32 = CombineCRC32(crc32,FillCRC32(0xFF,End-Start),End-Start);
+		if (Section->Loc == ImageHeaderStart)
+			Header = 1;
+		if (SectionCRC(fd,Section,Section->Loc == ImageHeaderStart,&SecCRC,&SecSize) != 0)
+			return 1;
+		crc32 = CombineCRC32(crc32,SecCRC,SecSize);
+		Pos = Section->Loc+Section->Size;
 	}
+	if ((!Header) || (Pos != FileSize))
+		return 1;
+
+	*pCRC = crc32;
 	return 0;
 }
-int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart)
+
+int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart,
+													SECTION_MAP *Map)
 {
 	unsigned long FileSize;
-	unsigned long i,crc32;
-	unsigned char data;
+	UINT32 crc32;
 	unsigned char Buffer[128];
 	unsigned char Mod100Checksum = 0;
+	SECTION *Header = NULL;
 
 
 	/* We want to calculate the checksum until the end of FIRMWARE MODULE section. */
 	FileSize = ImageHeaderStart+gBlkSize;
 	printf("FileSize = 0x%lX\n",FileSize);
 
-	/* Rewind file to make sure that it's at the begining */
-	rewind(fd);
-	/* Read the data and calculate crc32 */	
-	BeginCRC32(&crc32);
-	for(i = 0; i < FileSize; i++)
+	/* Use the section crcs if the whole layout is known, otherwise read 
+	 * the data and calculate crc32, skipping the FMH header checksum
+	 * and the module checksum fields of the FIRMWARE FMH */
+	if ((Map != NULL) && (MapImageCRC(fd,Map,ImageHeaderStart,FileSize,&crc32) == 0))
+	{
+		Header = FindOverlap(Map->Root,ImageHeaderStart,ImageHeaderStart+1);
+	}
+	else
 	{
-		if (fread(&data,sizeof(unsigned char),1,fd) != 1)
+		BeginCRC32(&crc32);
+		if ((CRCFileRange(fd,&crc32,0,
+				ImageHeaderStart+FMH_FMH_HEADER_CHECKSUM_OFFSET) != 0) ||
+		    (CRCFileRange(fd,&crc32,ImageHeaderStart+FMH_FMH_HEADER_CHECKSUM_OFFSET+1,
+				ImageHeaderStart+FMH_MODULE_CHECKSUM_START_OFFSET) != 0) ||
+		    (CRCFileRange(fd,&crc32,ImageHeaderStart+FMH_MODULE_CHCKSUM_END_OFFSET+1,
+				FileSize) != 0))
 		{
 			printf("ERROR: fread failed while reading image to calculate checksum\n");
 			return 0;
 		}
-		if((i >= (ImageHeaderStart+FMH_MODULE_CHECKSUM_START_OFFSET) && i <= (ImageHeaderStart+FMH_MODULE_CHCKSUM_END_OFFSET)) || (i == (ImageHeaderStart+FMH_FMH_HEADER_CHECKSUM_OFFSET)))
-			continue;
-		DoCRC32(&crc32,data);
+		EndCRC32(&crc32);
 	}
-	EndCRC32(&crc32);
 	crc32 = host_to_le32(crc32);
 	printf("Image checksum is 0x%lX\n",crc32);
 	/* Fill this image checksum in Module Checksum field of MODULE FIRMWARE */
-	fseek(fd,ImageHeaderStart+FMH_MODULE_CHECKSUM_START_OFFSET,SEEK_SET);
-	if(fwrite(&crc32,sizeof(unsigned long),1,fd) == 0)
-	if(fwrite(&crc32,sizeof(unsigned long),1,fd) == 0)
+	if(WriteImage(fd,ImageHeaderStart+FMH_MODULE_CHECKSUM_START_OFFSET,
+						&crc32,sizeof(UINT32)) != 0)
 	{
 		printf("ERROR: fwrite failed while updating image checksum field\n");
 		return 0;
@@ -820,13 +3300,20 @@ int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart)
 	/* Again, the assumption here is that the firmware module is at 
 	the begining (START) of the image. And also, that there's no alternate
 	FMH header for firmware module */
-	fseek(fd,ImageHeaderStart,SEEK_SET);
-	fread(Buffer,sizeof(unsigned char),sizeof(FMH),fd);
+	if (Header != NULL)
+	{
+		Header->Fmh.Module_Info.Module_Checksum = crc32;
+		memcpy(Buffer,&Header->Fmh,sizeof(FMH));
+	}
+	else
+	{
+		ReadImage(fd,ImageHeaderStart,Buffer,sizeof(FMH));
+	}
 	Mod100Checksum = CalculateModule100(Buffer,sizeof(FMH));
 	//printf("Mod100 Checksum is 0x%X\n",Mod100Checksum);
 
-	fseek(fd,ImageHeaderStart+FMH_FMH_HEADER_CHECKSUM_OFFSET,SEEK_SET);
-	if(fwrite(&Mod100Checksum,sizeof(unsigned char),1,fd) == 0)
+	if(WriteImage(fd,ImageHeaderStart+FMH_FMH_HEADER_CHECKSUM_OFFSET,
+					&Mod100Checksum,sizeof(unsigned char)) != 0)
 	{
 		printf("ERROR: fwrite failed while updating FMH modulo checksum field\n");
 		return 0;
@@ -834,3 +3321,24 @@ int CalculateImageChecksum(FILE* fd,unsigned long ImageHeaderStart)
 
 	return 1;
 }
+
+/* Image checksum of a dry run (--plan), from the section map alone. Also
+ * completes the FIRMWARE FMH of the map as it would be written */
+int
+PlanImageChecksum(SECTION_MAP *Map,unsigned long ImageHeaderStart,UINT32 *pCRC)
+{
+	SECTION *Header;
+	UINT32 crc32;
+
+	if (MapImageCRC(NULL,Map,ImageHeaderStart,ImageHeaderStart+gBlkSize,&crc32) != 0)
+		return 1;
+	Header = FindOverlap(Map->Root,ImageHeaderStart,ImageHeaderStart+1);
+	if (Header == NULL)
+		return 1;
+	printf("Image checksum is 0x%lX\n",crc32);
+	Header->Fmh.Module_Info.Module_Checksum = host_to_le32(crc32);
+	Header->Fmh.FMH_Header_Checksum = CalculateModule100((unsigned char *)&Header->Fmh,
+										sizeof(FMH));
+	*pCRC = crc32;
+	return 0;
+}
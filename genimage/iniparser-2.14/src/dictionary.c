@@ -41,11 +41,58 @@
 /** Invalid key token */
 #define DICT_INVALID_KEY    ((char*)-1)
 
+/** Size of the first string storage block */
+#define DICTBLOCKSZ	4096
+
+/** Hash table slot markers */
+#define DICT_EMPTY		(-1)
+#define DICT_TOMB		(-2)
+
+/** Hash table load limit, live plus deleted slots, in percent */
+#define DICT_MAXLOAD	75
+
 
 /*---------------------------------------------------------------------------
   							Private functions
  ---------------------------------------------------------------------------*/
 
+/* Block of the string storage of a dictionary. Strings are carved one
+ * after the other and are only released with the whole dictionary */
+typedef struct _dictionary_block_ {
+	struct _dictionary_block_ *	next ;
+	size_t		size ;		/* Bytes of data */
+	size_t		used ;
+} dict_block ;
+
+/* Copy a string into the storage of a dictionary */
+static char * dict_strdup(dictionary * d, char * str)
+{
+	dict_block	*	b ;
+	size_t			len ;
+	size_t			size ;
+	char		*	copy ;
+
+	len = strlen(str) + 1 ;
+	b = d->arena ;
+	if (b==NULL || b->size - b->used < len) {
+		/* Each new block is at least twice the previous one */
+		size = b ? 2*b->size : DICTBLOCKSZ ;
+		while (size < len)
+			size *= 2 ;
+		b = malloc(sizeof(dict_block) + size);
+		if (b==NULL)
+			return NULL ;
+		b->next = d->arena ;
+		b->size = size ;
+		b->used = 0 ;
+		d->arena = b ;
+	}
+	copy = (char *)(b+1) + b->used ;
+	memcpy(copy, str, len);
+	b->used += len ;
+	return copy ;
+}
+
 /* Doubles the allocated size associated to a pointer */
 /* 'size' is the current allocated size. */
 static void * mem_double(void * ptr, int size)
@@ -59,6 +106,192 @@ static void * mem_double(void * ptr, int size)
 }
 
 
+/* Distance of a table slot from the home slot of a hash */
+static int dict_dist(dictionary * d, unsigned hash, int slot)
+{
+	return (slot - (int)(hash & (d->tsize-1))) & (d->tsize-1) ;
+}
+
+/* Find the table slot holding a key, -1 if it is not there */
+static int dict_find(dictionary * d, char * key, unsigned hash)
+{
+	int		slot ;
+	int		dist ;
+	int		idx ;
+
+	slot = hash & (d->tsize-1) ;
+	for (dist=0 ; dist<d->tsize ; dist++) {
+		idx = d->table[slot] ;
+		if (idx==DICT_EMPTY)
+			return -1 ;
+		if (idx!=DICT_TOMB) {
+			/* Robin Hood: the key would have displaced this entry */
+			if (dict_dist(d, d->hash[idx], slot) < dist)
+				return -1 ;
+			if (d->hash[idx]==hash && !strcmp(key, d->key[idx]))
+				return slot ;
+		}
+		slot = (slot+1) & (d->tsize-1) ;
+	}
+	return -1 ;
+}
+
+/* Put list index idx in the hash table. Entries closer to their home
+ * slot give way to the one being placed */
+static void dict_place(dictionary * d, int idx)
+{
+	int		slot ;
+	int		dist ;
+	int		other ;
+	int		odist ;
+
+	slot = d->hash[idx] & (d->tsize-1) ;
+	for (dist=0 ; ; dist++) {
+		other = d->table[slot] ;
+		if (other==DICT_EMPTY) {
+			d->table[slot] = idx ;
+			return ;
+		}
+		/* Deleted slots are only reclaimed by dict_rehash: filling one
+		 * here could hide entries placed further on behind a closer one */
+		if (other==DICT_TOMB) {
+			slot = (slot+1) & (d->tsize-1) ;
+			continue ;
+		}
+		odist = dict_dist(d, d->hash[other], slot) ;
+		if (odist < dist) {
+			d->table[slot] = idx ;
+			idx  = other ;
+			dist = odist ;
+		}
+		slot = (slot+1) & (d->tsize-1) ;
+	}
+}
+
+/* Rebuild the hash table with tsize slots, dropping deleted ones */
+static void dict_rehash(dictionary * d, int tsize)
+{
+	int		i ;
+
+	free(d->table);
+	d->tsize = tsize ;
+	d->table = malloc(tsize * sizeof(int));
+	for (i=0 ; i<tsize ; i++)
+		d->table[i] = DICT_EMPTY ;
+	d->ntomb = 0 ;
+	for (i=0 ; i<d->last ; i++) {
+		if (d->key[i]!=NULL)
+			dict_place(d, i);
+	}
+}
+
+/* Smallest power of 2 hash table size for size list entries */
+static int dict_tsize(int size)
+{
+	int		tsize ;
+
+	for (tsize=1 ; tsize*DICT_MAXLOAD < size*100 ; tsize<<=1) ;
+	return tsize ;
+}
+
+/* Section number of a "section:key" key, -1 if there is no such section */
+static int dict_owner(dictionary * d, char * key)
+{
+	char		name[MAXVALSZ] ;
+	char	*	colon ;
+	int			len ;
+	int			slot ;
+
+	colon = strchr(key, ':');
+	len = colon - key ;
+	if (len>=MAXVALSZ)
+		return -1 ;
+	memcpy(name, key, len);
+	name[len] = 0 ;
+	slot = dict_find(d, name, dictionary_hash(name));
+	if (slot<0)
+		return -1 ;
+	return d->sowner[d->table[slot]] ;
+}
+
+/* Add list index i to the section index */
+static void dict_index(dictionary * d, int i)
+{
+	dictionary_section	*	sec ;
+	int			s ;
+
+	d->snext[i] = -1 ;
+	if (strchr(d->key[i], ':')==NULL) {
+		/* Section name */
+		if (d->nsec==d->secsize) {
+			d->sec = mem_double(d->sec, d->secsize * sizeof(dictionary_section));
+			d->secsize *= 2 ;
+		}
+		sec = &d->sec[d->nsec] ;
+		sec->key   = i ;
+		sec->first = -1 ;
+		sec->last  = -1 ;
+		d->sowner[i] = d->nsec++ ;
+		return ;
+	}
+
+	/* Key: chain it at the end of its section */
+	s = dict_owner(d, d->key[i]);
+	d->sowner[i] = s ;
+	if (s<0) {
+		d->norphan ++ ;
+		return ;
+	}
+	sec = &d->sec[s] ;
+	if (sec->last<0)
+		sec->first = i ;
+	else
+		d->snext[sec->last] = i ;
+	sec->last = i ;
+}
+
+/* Rebuild the section index from the lists */
+static void dict_reindex(dictionary * d)
+{
+	int		i ;
+
+	d->nsec = 0 ;
+	d->norphan = 0 ;
+	/* Sections first, so that every key finds its own */
+	for (i=0 ; i<d->last ; i++) {
+		if (d->key[i]!=NULL && strchr(d->key[i], ':')==NULL)
+			dict_index(d, i);
+	}
+	for (i=0 ; i<d->last ; i++) {
+		if (d->key[i]!=NULL && strchr(d->key[i], ':')!=NULL)
+			dict_index(d, i);
+	}
+}
+
+/* Close the holes left in the lists by deleted entries, keeping order */
+static void dict_compact(dictionary * d)
+{
+	int		i, j ;
+
+	for (i=0, j=0 ; i<d->last ; i++) {
+		if (d->key[i]==NULL)
+			continue ;
+		d->key[j]  = d->key[i] ;
+		d->val[j]  = d->val[i] ;
+		d->hash[j] = d->hash[i] ;
+		d->num[j]  = d->num[i] ;
+		d->parsed[j] = d->parsed[i] ;
+		j++ ;
+	}
+	for (i=j ; i<d->last ; i++) {
+		d->key[i]  = NULL ;
+		d->val[i]  = NULL ;
+		d->hash[i] = 0 ;
+		d->parsed[i] = 0 ;
+	}
+	d->last = j ;
+}
+
 /*---------------------------------------------------------------------------
   							Function codes
  ---------------------------------------------------------------------------*/
@@ -78,16 +311,38 @@ static void * mem_double(void * ptr, int size)
 
 unsigned dictionary_hash(char * key)
 {
-	int			len ;
-	unsigned	hash ;
-	int			i ;
+	return dictionary_hash_end(dictionary_hash_add(0, key));
+}
 
-	len = strlen(key);
-	for (hash=0, i=0 ; i<len ; i++) {
-		hash += (unsigned)key[i] ;
+/*-------------------------------------------------------------------------*/
+/**
+  @brief	Compute the hash key for a string in parts.
+  @param	hash	Hash of the previous parts (0 for the first one).
+  @param	part	Character string to add.
+  @return	Hash of the parts so far, to pass to dictionary_hash_end().
+ */
+/*--------------------------------------------------------------------------*/
+
+unsigned dictionary_hash_add(unsigned hash, char * part)
+{
+	for ( ; *part ; part++) {
+		hash += (unsigned)*part ;
 		hash += (hash<<10);
 		hash ^= (hash>>6) ;
 	}
+	return hash ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief	Finish a hash computed with dictionary_hash_add().
+  @param	hash	Hash of all the parts.
+  @return	1 unsigned int on at least 32 bits.
+ */
+/*--------------------------------------------------------------------------*/
+
+unsigned dictionary_hash_end(unsigned hash)
+{
 	hash += (hash <<3);
 	hash ^= (hash >>11);
 	hash += (hash <<15);
@@ -119,6 +374,13 @@ dictionary * dictionary_new(int size)
 	d->val  = calloc(size, sizeof(char*));
 	d->key  = calloc(size, sizeof(char*));
 	d->hash = calloc(size, sizeof(unsigned));
+	d->snext  = calloc(size, sizeof(int));
+	d->sowner = calloc(size, sizeof(int));
+	d->num    = calloc(size, sizeof(long));
+	d->parsed = calloc(size, sizeof(unsigned char));
+	d->secsize = 16 ;
+	d->sec  = calloc(d->secsize, sizeof(dictionary_section));
+	dict_rehash(d, dict_tsize(size));
 	return d ;
 }
 
@@ -135,18 +397,22 @@ dictionary * dictionary_new(int size)
 
 void dictionary_del(dictionary * d)
 {
-	int		i ;
+	dict_block	*	b ;
 
 	if (d==NULL) return ;
-	for (i=0 ; i<d->size ; i++) {
-		if (d->key[i]!=NULL)
-			free(d->key[i]);
-		if (d->val[i]!=NULL)
-			free(d->val[i]);
+	while ((b=d->arena)!=NULL) {
+		d->arena = b->next ;
+		free(b);
 	}
 	free(d->val);
 	free(d->key);
 	free(d->hash);
+	free(d->table);
+	free(d->sec);
+	free(d->snext);
+	free(d->sowner);
+	free(d->num);
+	free(d->parsed);
 	free(d);
 	return ;
 }
@@ -169,22 +435,48 @@ void dictionary_del(dictionary * d)
 /*--------------------------------------------------------------------------*/
 char * dictionary_get(dictionary * d, char * key, char * def)
 {
-	unsigned	hash ;
-	int			i ;
+	int			slot ;
 
-	hash = dictionary_hash(key);
-	for (i=0 ; i<d->size ; i++) {
-        if (d->key==NULL)
-            continue ;
-        /* Compare hash */
-		if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-				return d->val[i] ;
-			}
+	slot = dict_find(d, key, dictionary_hash(key));
+	if (slot<0)
+		return def ;
+	return d->val[d->table[slot]] ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief	Find a key made of two parts in a dictionary.
+  @param	d		dictionary object to search.
+  @param	prefix	First part of the key.
+  @param	key		Rest of the key.
+  @param	hash	dictionary hash of the whole key.
+  @return	Index of the entry in the key/val lists, -1 if not found.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_find(dictionary * d, char * prefix, char * key, unsigned hash)
+{
+	int		slot ;
+	int		dist ;
+	int		idx ;
+	size_t	len ;
+
+	len  = strlen(prefix);
+	slot = hash & (d->tsize-1) ;
+	for (dist=0 ; dist<d->tsize ; dist++) {
+		idx = d->table[slot] ;
+		if (idx==DICT_EMPTY)
+			return -1 ;
+		if (idx!=DICT_TOMB) {
+			if (dict_dist(d, d->hash[idx], slot) < dist)
+				return -1 ;
+			if (d->hash[idx]==hash &&
+			    !strncmp(prefix, d->key[idx], len) &&
+			    !strcmp(key, d->key[idx]+len))
+				return idx ;
 		}
+		slot = (slot+1) & (d->tsize-1) ;
 	}
-	return def ;
+	return -1 ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -288,6 +580,7 @@ double dictionary_getdouble(dictionary * d, char * key, double def)
 void dictionary_set(dictionary * d, char * key, char * val)
 {
 	int			i ;
+	int			slot ;
 	unsigned	hash ;
 
 	if (d==NULL || key==NULL) return ;
@@ -295,47 +588,54 @@ void dictionary_set(dictionary * d, char * key, char * val)
 	/* Compute hash for this key */
 	hash = dictionary_hash(key) ;
 	/* Find if value is already in blackboard */
-	if (d->n>0) {
-		for (i=0 ; i<d->size ; i++) {
-            if (d->key[i]==NULL)
-                continue ;
-			if (hash==d->hash[i]) { /* Same hash value */
-				if (!strcmp(key, d->key[i])) {	 /* Same key */
-					/* Found a value: modify and return */
-					if (d->val[i]!=NULL)
-						free(d->val[i]);
-                    d->val[i] = val ? strdup(val) : NULL ;
-                    /* Value has been modified: return */
-					return ;
-				}
-			}
-		}
+	slot = dict_find(d, key, hash);
+	if (slot>=0) {
+		/* Found a value: modify and return. The old value stays in the
+		 * string storage until the dictionary is deleted */
+		i = d->table[slot] ;
+		d->val[i] = val ? dict_strdup(d, val) : NULL ;
+		d->parsed[i] = 0 ;
+		return ;
 	}
-	/* Add a new value */
-	/* See if dictionary needs to grow */
-	if (d->n==d->size) {
-
-		/* Reached maximum size: reallocate blackboard */
-		d->val  = mem_double(d->val,  d->size * sizeof(char*)) ;
-		d->key  = mem_double(d->key,  d->size * sizeof(char*)) ;
-		d->hash = mem_double(d->hash, d->size * sizeof(unsigned)) ;
-
-		/* Double size */
-		d->size *= 2 ;
+	/* Add a new value at the end of the lists */
+	if (d->last==d->size) {
+		if (d->n < d->size/2) {
+			/* Mostly deleted entries: reuse their room */
+			dict_compact(d);
+			dict_rehash(d, d->tsize);
+			dict_reindex(d);
+		} else {
+			/* Reached maximum size: reallocate blackboard */
+			d->val  = mem_double(d->val,  d->size * sizeof(char*)) ;
+			d->key  = mem_double(d->key,  d->size * sizeof(char*)) ;
+			d->hash = mem_double(d->hash, d->size * sizeof(unsigned)) ;
+			d->snext  = mem_double(d->snext,  d->size * sizeof(int)) ;
+			d->sowner = mem_double(d->sowner, d->size * sizeof(int)) ;
+			d->num    = mem_double(d->num,    d->size * sizeof(long)) ;
+			d->parsed = mem_double(d->parsed, d->size * sizeof(unsigned char)) ;
+
+			/* Double size */
+			d->size *= 2 ;
+			dict_compact(d);
+			dict_rehash(d, dict_tsize(d->size));
+			dict_reindex(d);
+		}
 	}
 
-    /* Insert key in the first empty slot */
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL) {
-            /* Add key here */
-            break ;
-        }
-    }
+	i = d->last++ ;
 	/* Copy key */
-	d->key[i]  = strdup(key);
-    d->val[i]  = val ? strdup(val) : NULL ;
+	d->key[i]  = dict_strdup(d, key);
+	d->val[i]  = val ? dict_strdup(d, val) : NULL ;
 	d->hash[i] = hash;
+	d->parsed[i] = 0 ;
 	d->n ++ ;
+	dict_place(d, i);
+
+	/* A new section may be the one of keys added before it */
+	if (d->norphan>0 && strchr(key, ':')==NULL)
+		dict_reindex(d);
+	else
+		dict_index(d, i);
 	return ;
 }
 
@@ -352,35 +652,50 @@ void dictionary_set(dictionary * d, char * key, char * val)
 /*--------------------------------------------------------------------------*/
 void dictionary_unset(dictionary * d, char * key)
 {
-	unsigned	hash ;
-	int			i ;
+	int			slot ;
+	int			i, j ;
+	int			s ;
+	int			prev ;
+	int			unsec = 0 ;
+
+	slot = dict_find(d, key, dictionary_hash(key));
+	if (slot<0)
+		/* Key not found */
+		return ;
 
-	hash = dictionary_hash(key);
-	for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-		if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                /* Found key */
-                break ;
-			}
-		}
+	/* Leave a tombstone so that probing goes on past this slot */
+	i = d->table[slot] ;
+	d->table[slot] = DICT_TOMB ;
+	d->ntomb ++ ;
+
+	/* Take it out of the section index */
+	s = d->sowner[i] ;
+	if (strchr(d->key[i], ':')==NULL) {
+		unsec = 1 ;
+	} else if (s<0) {
+		d->norphan -- ;
+	} else {
+		prev = -1 ;
+		for (j=d->sec[s].first ; j!=i ; j=d->snext[j])
+			prev = j ;
+		if (prev<0)
+			d->sec[s].first = d->snext[i] ;
+		else
+			d->snext[prev] = d->snext[i] ;
+		if (d->sec[s].last==i)
+			d->sec[s].last = prev ;
 	}
-    if (i>=d->size)
-        /* Key not found */
-        return ;
-
-    free(d->key[i]);
-    d->key[i] = NULL ;
-    if (d->val[i]!=NULL) {
-        free(d->val[i]);
-        d->val[i] = NULL ;
-    }
-    d->hash[i] = 0 ;
-    d->n -- ;
-    return ;
+
+	d->key[i] = NULL ;
+	d->val[i] = NULL ;
+	d->hash[i] = 0 ;
+	d->parsed[i] = 0 ;
+	d->n -- ;
+
+	/* Sections are renumbered and their keys left without section */
+	if (unsec)
+		dict_reindex(d);
+	return ;
 }
 
 
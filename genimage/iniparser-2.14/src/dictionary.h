@@ -37,14 +37,36 @@
  ---------------------------------------------------------------------------*/
 
 
+/** Flags of the values cached next to a string value */
+#define DICT_PARSED_LONG	0x01	/** num holds the value as a long */
+#define DICT_PARSED_BOOL	0x02	/** The value was checked for a boolean */
+#define DICT_BOOL_TRUE		0x04
+#define DICT_BOOL_FALSE		0x08
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief	Section of a dictionary
+
+  Keys stored as "section:key" belong to the section whose name is stored
+  as a key without colon. The keys of a section are chained in insertion
+  order, so that they can be walked without looking at the other keys.
+ */
+/*-------------------------------------------------------------------------*/
+typedef struct _dictionary_section_ {
+	int		key ;	/** List index of the section name */
+	int		first ;	/** List index of the first key, -1 if none */
+	int		last ;	/** List index of the last key, -1 if none */
+} dictionary_section ;
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief	Dictionary object
 
   This object contains a list of string/string associations. Each
-  association is identified by a unique string key. Looking up values
-  in the dictionary is speeded up by the use of a (hopefully collision-free)
-  hash function.
+  association is identified by a unique string key. The key, val and
+  hash lists keep the associations in insertion order (deleted ones
+  leave a NULL key behind). Looking up values goes through an open
+  addressing (Robin Hood) hash table holding indexes into these lists.
  */
 /*-------------------------------------------------------------------------*/
 typedef struct _dictionary_ {
@@ -53,6 +75,19 @@ typedef struct _dictionary_ {
 	char 		**	val ;	/** List of string values */
 	char 		**  key ;	/** List of string keys */
 	unsigned	 *	hash ;	/** List of hash values for keys */
+	int				last ;	/** Number of list slots used, including deleted ones */
+	int			 *	table ;	/** Hash table of list indexes */
+	int				tsize ;	/** Hash table size (a power of 2) */
+	int				ntomb ;	/** Deleted hash table slots */
+	int				nsec ;	/** Number of sections */
+	int				secsize ;	/** Section storage size */
+	dictionary_section * sec ;	/** Sections in insertion order */
+	int			 *	snext ;	/** Next key of the same section, -1 at the end */
+	int			 *	sowner ;	/** Section number of a key or section name, -1 if none */
+	int				norphan ;	/** Keys whose section does not exist */
+	struct _dictionary_block_ * arena ;	/** Storage of the key and value strings */
+	long		 *	num ;	/** Value parsed as a number, see parsed */
+	unsigned char *	parsed ;	/** DICT_PARSED_xxx flags of each value */
 } dictionary ;
 
 
@@ -74,6 +109,29 @@ typedef struct _dictionary_ {
 /*--------------------------------------------------------------------------*/
 unsigned dictionary_hash(char * key);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Compute the hash key for a string in parts.
+  @param    hash    Hash of the previous parts (0 for the first one).
+  @param    part    Character string to add.
+  @return   Hash of the parts so far, to pass to dictionary_hash_end().
+
+  dictionary_hash_end(dictionary_hash_add(dictionary_hash_add(0,"a"),"b"))
+  is dictionary_hash("ab"). This lets the hash of a common prefix be
+  computed only once.
+ */
+/*--------------------------------------------------------------------------*/
+unsigned dictionary_hash_add(unsigned hash, char * part);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Finish a hash computed with dictionary_hash_add().
+  @param    hash    Hash of all the parts.
+  @return   1 unsigned int on at least 32 bits.
+ */
+/*--------------------------------------------------------------------------*/
+unsigned dictionary_hash_end(unsigned hash);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Create a new dictionary object.
@@ -93,7 +151,9 @@ dictionary * dictionary_new(int size);
   @param    d   dictionary object to deallocate.
   @return   void
 
-  Deallocate a dictionary object and all memory associated to it.
+  Deallocate a dictionary object and all memory associated to it. Keys and
+  values live in a few large blocks, so this does not depend on the number
+  of entries.
  */
 /*--------------------------------------------------------------------------*/
 void dictionary_del(dictionary * vd);
@@ -114,6 +174,21 @@ void dictionary_del(dictionary * vd);
 /*--------------------------------------------------------------------------*/
 char * dictionary_get(dictionary * d, char * key, char * def);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find a key made of two parts in a dictionary.
+  @param    d       dictionary object to search.
+  @param    prefix  First part of the key.
+  @param    key     Rest of the key.
+  @param    hash    dictionary hash of the whole key.
+  @return   Index of the entry in the key/val lists, -1 if not found.
+
+  Looks for the key prefix followed by key, without building it. The
+  index stays valid until keys are added to or removed from d.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_find(dictionary * d, char * prefix, char * key, unsigned hash);
+
 
 /*-------------------------------------------------------------------------*/
 /**
@@ -23,6 +23,12 @@
 #include "iniparser.h"
 #include "strlib.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #define ASCIILINESZ         1024
 #define INI_INVALID_KEY     ((char*)-1)
 
@@ -30,27 +36,54 @@
                         Private to this module
  ---------------------------------------------------------------------------*/
 
-/* Private: add an entry to the dictionary */
-static void iniparser_add_entry(
-    dictionary * d,
-    char * sec,
-    char * key,
-    char * val)
+/* Private: convert a value to a long. Hexadecimal (0x) and sizes in
+ * kilobytes (K) or megabytes (M) are accepted */
+static long iniparser_strtolong(char * str)
 {
-    char longkey[2*ASCIILINESZ+1];
+	int len;
+	long value;
 
-    /* Make a key as section:keyword */
-    if (key!=NULL) {
-        sprintf(longkey, "%s:%s", sec, key);
-    } else {
-        strcpy(longkey, sec);
-    }
+/* Check if it is hexadecimal */
+	len = strlen(str);
+	if (len > 2)
+	{
+		if ((str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X')))
+		{
+			sscanf(str,"%lx",&value);
+			return value;
+		}
+	}
+	if (len == 0)
+		return 0;
 
-    /* Add (key,val) to dictionary */
-    dictionary_set(d, longkey, val);
-    return ;
+/* Check if specified in Kilobytes */	
+	if ((str[len-1] == 'K') || (str[len-1] == 'k'))
+	{
+		value = atol(str);
+		return value*1024;
+	}
+	
+/* Check if specified in Megabytes */	
+	if ((str[len-1] == 'M') || (str[len-1] == 'm'))
+	{
+		value = atol(str);
+		return value*1024*1024;
+	}
+	
+/* Normal long integer */	
+    return atol(str);
 }
 
+/* Private: convert a value to a boolean, -1 if it is not one */
+static int iniparser_strtobool(char * c)
+{
+    if (c[0]=='y' || c[0]=='Y' || c[0]=='1' || c[0]=='t' || c[0]=='T') {
+        return 1 ;
+    } else if (c[0]=='n' || c[0]=='N' || c[0]=='0' || c[0]=='f' || c[0]=='F') {
+        return 0 ;
+    }
+    return -1 ;
+}
 
 /*-------------------------------------------------------------------------*/
 /**
@@ -73,19 +106,8 @@ static void iniparser_add_entry(
 
 int iniparser_getnsec(dictionary * d)
 {
-    int i ;
-    int nsec ;
-
     if (d==NULL) return -1 ;
-    nsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        if (strchr(d->key[i], ':')==NULL) {
-            nsec ++ ;
-        }
-    }
-    return nsec ;
+    return d->nsec ;
 }
 
 
@@ -106,24 +128,85 @@ int iniparser_getnsec(dictionary * d)
 
 char * iniparser_getsecname(dictionary * d, int n)
 {
-    int i ;
-    int foundsec ;
+    if (d==NULL || n<0 || n>=d->nsec) return NULL ;
+    return d->key[d->sec[n].key] ;
+}
 
-    if (d==NULL || n<0) return NULL ;
-    foundsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        if (strchr(d->key[i], ':')==NULL) {
-            foundsec++ ;
-            if (foundsec>n)
-                break ;
-        }
-    }
-    if (foundsec<=n) {
-        return NULL ;
-    }
-    return d->key[i] ;
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the first key of section n in a dictionary.
+  @param    d   Dictionary to examine
+  @param    n   Section number (from 0 to nsec-1).
+  @return   Iterator on the key, -1 if the section has no key.
+
+  Together with iniparser_secnext() this walks the keys of one section,
+  in the order they were added, without looking at the other keys:
+
+    for (it=iniparser_secfirst(d, n) ; it>=0 ; it=iniparser_secnext(d, it))
+        printf("%s = %s\n", iniparser_iterkey(d, it), iniparser_iterval(d, it));
+
+  The iterator is invalidated when keys are added to or removed from the
+  dictionary.
+ */
+/*--------------------------------------------------------------------------*/
+
+int iniparser_secfirst(dictionary * d, int n)
+{
+    if (d==NULL || n<0 || n>=d->nsec) return -1 ;
+    return d->sec[n].first ;
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the next key of the same section.
+  @param    d   Dictionary to examine
+  @param    it  Iterator returned by iniparser_secfirst/iniparser_secnext
+  @return   Iterator on the next key, -1 at the end of the section.
+ */
+/*--------------------------------------------------------------------------*/
+
+int iniparser_secnext(dictionary * d, int it)
+{
+    if (d==NULL || it<0 || it>=d->last) return -1 ;
+    return d->snext[it] ;
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the key name (without section) at an iterator.
+  @param    d   Dictionary to examine
+  @param    it  Iterator on a key
+  @return   Pointer to char string, NULL in case of error.
+
+  Do not free or modify the returned string!
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_iterkey(dictionary * d, int it)
+{
+    if (d==NULL || it<0 || it>=d->last || d->key[it]==NULL) return NULL ;
+    return strchr(d->key[it], ':')+1 ;
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value at an iterator.
+  @param    d   Dictionary to examine
+  @param    it  Iterator on a key
+  @return   Pointer to char string, NULL if there is no value.
+
+  Do not free or modify the returned string!
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_iterval(dictionary * d, int it)
+{
+    if (d==NULL || it<0 || it>=d->last) return NULL ;
+    return d->val[it] ;
 }
 
 
@@ -171,11 +254,9 @@ void iniparser_dump(dictionary * d, FILE * f)
 
 void iniparser_dump_ini(dictionary * d, FILE * f)
 {
-    int     i, j ;
-    char    keym[ASCIILINESZ+1];
+    int     i, it ;
     int     nsec ;
     char *  secname ;
-    int     seclen ;
 
     if (d==NULL || f==NULL) return ;
 
@@ -190,19 +271,13 @@ void iniparser_dump_ini(dictionary * d, FILE * f)
         return ;
     }
     for (i=0 ; i<nsec ; i++) {
-        secname = iniparser_getsecname(d, i) ;
-        seclen  = (int)strlen(secname);
+        secname = d->key[d->sec[i].key] ;
         fprintf(f, "\n[%s]\n", secname);
-        sprintf(keym, "%s:", secname);
-        for (j=0 ; j<d->size ; j++) {
-            if (d->key[j]==NULL)
-                continue ;
-            if (!strncmp(d->key[j], keym, seclen+1)) {
-                fprintf(f,
-                        "%-30s = %s\n",
-                        d->key[j]+seclen+1,
-                        d->val[j] ? d->val[j] : "");
-            }
+        for (it=d->sec[i].first ; it>=0 ; it=d->snext[it]) {
+            fprintf(f,
+                    "%-30s = %s\n",
+                    strchr(d->key[it], ':')+1,
+                    d->val[it] ? d->val[it] : "");
         }
     }
     fprintf(f, "\n");
@@ -335,39 +410,10 @@ int iniparser_getint(dictionary * d, char * key, int notfound)
 long iniparser_getlong(dictionary * d, char * key,  long notfound)
 {
     char    *   str ;
-	int len;
-	long value;
 
     str = iniparser_getstring(d, key, INI_INVALID_KEY);
     if (str==INI_INVALID_KEY) return notfound ;
-
-/* Check if it is hexadecimal */
-	len = strlen(str);
-	if (len > 2)
-	{
-		if ((str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X')))
-		{
-			sscanf(str,"%lx",&value);
-			return value;
-		}
-	}
-
-/* Check if specified in Kilobytes */	
-	if ((str[len-1] == 'K') || (str[len-1] == 'k'))
-	{
-		value = atol(str);
-		return value*1024;
-	}
-	
-/* Check if specified in Megabytes */	
-	if ((str[len-1] == 'M') || (str[len-1] == 'm'))
-	{
-		value = atol(str);
-		return value*1024*1024;
-	}
-	
-/* Normal long integer */	
-    return atol(str);
+    return iniparser_strtolong(str);
 }
 
 
@@ -434,17 +480,187 @@ int iniparser_getboolean(dictionary * d, char * key, int notfound)
 
     c = iniparser_getstring(d, key, INI_INVALID_KEY);
     if (c==INI_INVALID_KEY) return notfound ;
-    if (c[0]=='y' || c[0]=='Y' || c[0]=='1' || c[0]=='t' || c[0]=='T') {
-        ret = 1 ;
-    } else if (c[0]=='n' || c[0]=='N' || c[0]=='0' || c[0]=='f' || c[0]=='F') {
-        ret = 0 ;
-    } else {
+    ret = iniparser_strtobool(c);
+    if (ret<0)
         ret = notfound ;
-    }
     return ret;
 }
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get a handle on a section of a dictionary
+  @param    d       Dictionary to search
+  @param    name    Section name
+  @return   Section handle
+
+  The handle keeps the hash of "name:", so that the section_get*()
+  functions only hash the key name, and find the key without building
+  the full "section:key" string. If the section does not exist, the
+  section_get*() functions return their default value.
+  The handle stays valid until sections are removed from d.
+ */
+/*--------------------------------------------------------------------------*/
+inisection iniparser_section(dictionary * d, char * name)
+{
+    inisection  sec ;
+    char    *   lc_name ;
+    int         i ;
+
+    sec.d = d ;
+    sec.name = NULL ;
+    sec.hash = 0 ;
+    if (d==NULL || name==NULL)
+        return sec ;
+
+    lc_name = strlwc(name);
+    i = dictionary_find(d, lc_name, "", dictionary_hash(lc_name));
+    if (i>=0) {
+        sec.name = d->key[i] ;
+        sec.hash = dictionary_hash_add(0, sec.name);
+    }
+    return sec ;
+}
+
+/* Private: find key in a section, -1 if it is not there */
+static int section_find(inisection sec, char * key)
+{
+    char    lc_key[ASCIILINESZ+2];
+    int     i ;
+
+    if (sec.name==NULL || key==NULL)
+        return -1 ;
+
+    /* Keys are stored lower case, after a colon */
+    lc_key[0] = ':' ;
+    for (i=0 ; key[i] && i<ASCIILINESZ ; i++)
+        lc_key[i+1] = (char)tolower((int)(unsigned char)key[i]) ;
+    lc_key[i+1] = (char)0 ;
+
+    return dictionary_find(sec.d, sec.name, lc_key,
+                dictionary_hash_end(dictionary_hash_add(sec.hash, lc_key)));
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the string associated to a key of a section
+  @param    sec     Section handle
+  @param    key     Key name, without section
+  @param    def     Default value to return if key not found.
+  @return   pointer to statically allocated character string
+
+  Same as iniparser_getstring() for "section:key". Do not free or modify
+  the returned string.
+ */
+/*--------------------------------------------------------------------------*/
+char * section_getstring(inisection sec, char * key, char * def)
+{
+    int     i ;
+
+    i = section_find(sec, key);
+    if (i<0)
+        return def ;
+    return sec.d->val[i] ;
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the string associated to a key of a section, or NULL
+  @param    sec     Section handle
+  @param    key     Key name, without section
+  @return   pointer to statically allocated character string, or NULL.
+ */
+/*--------------------------------------------------------------------------*/
+char * section_getstr(inisection sec, char * key)
+{
+    return section_getstring(sec, key, NULL);
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as a long
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   long
+
+  Same as iniparser_getlong() for "section:key". The converted value is
+  kept next to the string, so it is converted only once.
+ */
+/*--------------------------------------------------------------------------*/
+long section_getlong(inisection sec, char * key, long notfound)
+{
+    dictionary  *   d = sec.d ;
+    int             i ;
+
+    i = section_find(sec, key);
+    if (i<0 || d->val[i]==NULL)
+        return notfound ;
+    if (!(d->parsed[i] & DICT_PARSED_LONG)) {
+        d->num[i] = iniparser_strtolong(d->val[i]);
+        d->parsed[i] |= DICT_PARSED_LONG ;
+    }
+    return d->num[i] ;
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as an int
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   integer
+
+  Same as iniparser_getint() for "section:key".
+ */
+/*--------------------------------------------------------------------------*/
+int section_getint(inisection sec, char * key, int notfound)
+{
+    return (int)section_getlong(sec, key, notfound);
+}
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as a boolean
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   integer
+
+  Same as iniparser_getboolean() for "section:key". The result of the
+  conversion is kept next to the string.
+ */
+/*--------------------------------------------------------------------------*/
+int section_getboolean(inisection sec, char * key, int notfound)
+{
+    dictionary  *   d = sec.d ;
+    int             i ;
+    int             ret ;
+
+    i = section_find(sec, key);
+    if (i<0 || d->val[i]==NULL)
+        return notfound ;
+    if (!(d->parsed[i] & DICT_PARSED_BOOL)) {
+        ret = iniparser_strtobool(d->val[i]);
+        d->parsed[i] |= DICT_PARSED_BOOL ;
+        if (ret==1)
+            d->parsed[i] |= DICT_BOOL_TRUE ;
+        else if (ret==0)
+            d->parsed[i] |= DICT_BOOL_FALSE ;
+    }
+    if (d->parsed[i] & DICT_BOOL_TRUE)
+        return 1 ;
+    if (d->parsed[i] & DICT_BOOL_FALSE)
+        return 0 ;
+    return notfound ;
+}
+
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Finds out if a given entry exists in a dictionary
@@ -523,56 +739,198 @@ void iniparser_unset(dictionary * ini, char * entry)
  */
 /*--------------------------------------------------------------------------*/
 
-dictionary * iniparser_load(char * ininame)
+/* Private: copy [s,e) to buf lower cased, dropping trailing blanks */
+static void iniparser_copylwc(char * buf, char * s, char * e)
+{
+    while (e>s && isspace((int)(unsigned char)e[-1]))
+        e-- ;
+    if (e-s > ASCIILINESZ)
+        e = s + ASCIILINESZ ;
+    while (s<e)
+        *buf++ = (char)tolower((int)(unsigned char)*s++) ;
+    *buf = (char)0 ;
+}
+
+/* Private: copy [s,e) to buf, dropping trailing blanks */
+static void iniparser_copyval(char * buf, char * s, char * e)
+{
+    while (e>s && isspace((int)(unsigned char)e[-1]))
+        e-- ;
+    if (e-s > ASCIILINESZ)
+        e = s + ASCIILINESZ ;
+    memcpy(buf, s, e-s);
+    buf[e-s] = (char)0 ;
+}
+
+/* Private: parse size bytes of ini text into d, in one pass */
+static void iniparser_parse(dictionary * d, char * text, size_t size)
 {
-    dictionary  *   d ;
-    char        lin[ASCIILINESZ+1];
     char        sec[ASCIILINESZ+1];
-    char        key[ASCIILINESZ+1];
+    char        key[2*ASCIILINESZ+2];
     char        val[ASCIILINESZ+1];
+    char    *   end = text + size ;
+    char    *   eol ;
     char    *   where ;
-    FILE    *   ini ;
-    int         lineno ;
+    char    *   eq ;
+    char    *   v ;
+    char    *   q ;
+    int         seclen ;
 
-    if ((ini=fopen(ininame, "r"))==NULL) {
-        return NULL ;
+    sec[0]=0;
+    seclen=0;
+    for ( ; text<end ; text=eol+1) {
+        eol = memchr(text, '\n', end-text);
+        if (eol==NULL)
+            eol = end ;
+
+        /* Skip leading spaces */
+        for (where=text ; where<eol && isspace((int)(unsigned char)*where) ; where++) ;
+        if (where==eol || *where==';' || *where=='#')
+            continue ; /* Comment lines */
+
+        if (*where=='[' && where+1<eol && where[1]!=']') {
+            /* Valid section name */
+            q = memchr(where+1, ']', eol-where-1);
+            iniparser_copylwc(sec, where+1, q ? q : eol);
+            seclen = strlen(sec);
+            dictionary_set(d, sec, NULL);
+            continue ;
+        }
+
+        /* key = value, key = "value" or key = 'value' */
+        eq = memchr(where, '=', eol-where);
+        if (eq==NULL || eq==where)
+            continue ;
+        for (v=eq+1 ; v<eol && isspace((int)(unsigned char)*v) ; v++) ;
+        if (v==eol)
+            continue ;
+
+        if (*v=='"' || *v=='\'') {
+            /* Quoted, up to the closing quote or the end of the line */
+            q = memchr(v+1, *v, eol-v-1);
+            iniparser_copyval(val, v+1, q ? q : eol);
+        } else {
+            for (q=v ; q<eol && *q!=';' && *q!='#' ; q++) ;
+            if (q==v)
+                continue ;
+            iniparser_copyval(val, v, q);
+        }
+
+        /* Make a key as section:keyword */
+        memcpy(key, sec, seclen);
+        key[seclen] = ':' ;
+        iniparser_copylwc(key+seclen+1, where, eq);
+        dictionary_set(d, key, val);
     }
+}
 
-    sec[0]=0;
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Parse an ini file and return an allocated dictionary object
+  @param    ininame Name of the ini file to read.
+  @return   Pointer to newly allocated dictionary
 
-    /*
-     * Initialize a new dictionary entry
-     */
-    d = dictionary_new(0);
-    lineno = 0 ;
-    while (fgets(lin, ASCIILINESZ, ini)!=NULL) {
-        lineno++ ;
-        where = strskp(lin); /* Skip leading spaces */
-        if (*where==';' || *where=='#' || *where==0)
-            continue ; /* Comment lines */
-        else {
-            if (sscanf(where, "[%[^]]", sec)==1) {
-                /* Valid section name */
-                strcpy(sec, strlwc(sec));
-                iniparser_add_entry(d, sec, NULL, NULL);
-            } else if (sscanf (where, "%[^=] = \"%[^\"]\"", key, val) == 2
-                   ||  sscanf (where, "%[^=] = '%[^\']'",   key, val) == 2
-                   ||  sscanf (where, "%[^=] = %[^;#]",     key, val) == 2) {
-                strcpy(key, strlwc(strcrop(key)));
-                /*
-                 * sscanf cannot handle "" or '' as empty value,
-                 * this is done here
-                 */
-                if (!strcmp(val, "\"\"") || !strcmp(val, "''")) {
-                    val[0] = (char)0;
-                } else {
-                    strcpy(val, strcrop(val));
+  This is the parser for ini files. This function is called, providing
+  the name of the file to be read. It returns a dictionary object that
+  should not be accessed directly, but through accessor functions
+  instead.
+
+  A regular file is mapped; anything else (a pipe, a FIFO, /dev/stdin)
+  is read until end of file. The text is parsed in a single pass. All
+  keys and values are stored in a few large blocks owned by the
+  dictionary.
+
+  The returned dictionary must be freed using iniparser_freedict().
+ */
+/*--------------------------------------------------------------------------*/
+
+dictionary * iniparser_load(char * ininame)
+{
+    dictionary  *   d ;
+    struct stat     st ;
+    char        *   text ;
+    char        *   p ;
+    size_t          size ;
+    char        *   more ;
+    size_t          alloc ;
+    size_t          done ;
+    ssize_t         len ;
+    int             mapped ;
+    int             lines ;
+    int             fd ;
+
+    if ((fd=open(ininame, O_RDONLY))<0) {
+        return NULL ;
+    }
+    if (fstat(fd, &st)!=0) {
+        close(fd);
+        return NULL ;
+    }
+    size = st.st_size ;
+
+    text = NULL ;
+    mapped = 0 ;
+    if (S_ISREG(st.st_mode) && size>0) {
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text!=MAP_FAILED) {
+            mapped = 1 ;
+            madvise(text, size, MADV_SEQUENTIAL);
+        } else {
+            text = NULL ;
+        }
+    }
+    if (!mapped) {
+        /* Pipe, FIFO or unmappable file: the size is not known (st_size
+         * is 0 for a pipe), read it all into a growing buffer */
+        alloc = (size>0) ? size : 4096 ;
+        text = malloc(alloc);
+        done = 0 ;
+        while (text!=NULL) {
+            if (done==alloc) {
+                more = realloc(text, alloc*2);
+                if (more==NULL) {
+                    free(text);
+                    text = NULL ;
+                    break ;
                 }
-                iniparser_add_entry(d, sec, key, val);
+                text = more ;
+                alloc *= 2 ;
+            }
+            len = read(fd, text+done, alloc-done);
+            if (len<0 && errno==EINTR)
+                continue ;
+            if (len<0) {
+                free(text);
+                text = NULL ;
+                break ;
             }
+            if (len==0)
+                break ;
+            done += len ;
         }
+        size = done ;
+    }
+    close(fd);
+    if (text==NULL) {
+        return NULL ;
     }
-    fclose(ini);
+
+    /* Size the dictionary for one entry per line */
+    lines = 0 ;
+    for (p=text ; p!=NULL && (p=memchr(p, '\n', text+size-p))!=NULL ; p++)
+        lines++ ;
+
+    /*
+     * Initialize a new dictionary entry
+     */
+    d = dictionary_new(lines+1);
+    if (size>0)
+        iniparser_parse(d, text, size);
+
+    if (mapped)
+        munmap(text, size);
+    else
+        free(text);
     return d ;
 }
 
@@ -584,7 +942,9 @@ dictionary * iniparser_load(char * ininame)
   @param    d Dictionary to free
   @return   void
 
-  Free all memory associated to an ini dictionary.
+  Free all memory associated to an ini dictionary. The keys and values
+  are held in a few large blocks, so this does not depend on the number
+  of entries.
   It is mandatory to call this function before the dictionary object
   gets out of the current context.
  */
@@ -30,6 +30,20 @@
 
 #include "dictionary.h"
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Handle on a section of a dictionary
+
+  Returned by iniparser_section(), to read the keys of one section with
+  the section_get*() functions.
+ */
+/*-------------------------------------------------------------------------*/
+typedef struct _inisection_ {
+    dictionary  *   d ;     /** Dictionary of the section */
+    char        *   name ;  /** Section name as stored in d, NULL if none */
+    unsigned        hash ;  /** Partial dictionary hash of the name */
+} inisection ;
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Get number of sections in a dictionary
@@ -70,6 +84,58 @@ int iniparser_getnsec(dictionary * d);
 char * iniparser_getsecname(dictionary * d, int n);
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the first key of section n in a dictionary.
+  @param    d   Dictionary to examine
+  @param    n   Section number (from 0 to nsec-1).
+  @return   Iterator on the key, -1 if the section has no key.
+
+  Use iniparser_secnext() to go to the next key of the section, and
+  iniparser_iterkey()/iniparser_iterval() to read the key at an iterator.
+  Iterators are invalidated when keys are added or removed.
+ */
+/*--------------------------------------------------------------------------*/
+
+int iniparser_secfirst(dictionary * d, int n);
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the next key of the same section.
+  @param    d   Dictionary to examine
+  @param    it  Iterator returned by iniparser_secfirst/iniparser_secnext
+  @return   Iterator on the next key, -1 at the end of the section.
+ */
+/*--------------------------------------------------------------------------*/
+
+int iniparser_secnext(dictionary * d, int it);
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the key name (without section) at an iterator.
+  @param    d   Dictionary to examine
+  @param    it  Iterator on a key
+  @return   Pointer to char string, NULL in case of error.
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_iterkey(dictionary * d, int it);
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value at an iterator.
+  @param    d   Dictionary to examine
+  @param    it  Iterator on a key
+  @return   Pointer to char string, NULL if there is no value.
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_iterval(dictionary * d, int it);
+
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Save a dictionary to a loadable ini file
@@ -245,6 +311,79 @@ int iniparser_setstr(dictionary * ini, char * entry, char * val);
 /*--------------------------------------------------------------------------*/
 void iniparser_unset(dictionary * ini, char * entry);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get a handle on a section of a dictionary
+  @param    d       Dictionary to search
+  @param    name    Section name
+  @return   Section handle
+
+  The section_get*() functions read the keys of the section through the
+  handle, hashing only the key name. If the section does not exist they
+  return their default value.
+ */
+/*--------------------------------------------------------------------------*/
+inisection iniparser_section(dictionary * d, char * name);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the string associated to a key of a section
+  @param    sec     Section handle
+  @param    key     Key name, without section
+  @param    def     Default value to return if key not found.
+  @return   pointer to statically allocated character string
+ */
+/*--------------------------------------------------------------------------*/
+char * section_getstring(inisection sec, char * key, char * def);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the string associated to a key of a section, or NULL
+  @param    sec     Section handle
+  @param    key     Key name, without section
+  @return   pointer to statically allocated character string, or NULL.
+ */
+/*--------------------------------------------------------------------------*/
+char * section_getstr(inisection sec, char * key);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as an int
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   integer
+ */
+/*--------------------------------------------------------------------------*/
+int section_getint(inisection sec, char * key, int notfound);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as a long
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   long
+
+  The converted value is kept next to the string, so later calls for
+  the same key do not convert it again.
+ */
+/*--------------------------------------------------------------------------*/
+long section_getlong(inisection sec, char * key, long notfound);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the value of a key of a section, as a boolean
+  @param    sec         Section handle
+  @param    key         Key name, without section
+  @param    notfound    Value to return in case of error
+  @return   integer
+
+  See iniparser_getboolean() for the accepted values.
+ */
+/*--------------------------------------------------------------------------*/
+int section_getboolean(inisection sec, char * key, int notfound);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Finds out if a given entry exists in a dictionary